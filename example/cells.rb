@@ -0,0 +1,24 @@
+#!mruby
+
+FLTK3.refresh_rate = 30
+
+window = FLTK3::Window.new(100, 100, 420, 445, "mruby-fltk3")
+cells = []
+window.begin do
+  100.times do |i|
+    cell = FLTK3::Cell.new(0)
+    output = FLTK3::ValueOutput.new(10 + (i % 5) * 80, 10 + (i / 5) * 20, 75, 18)
+    output.bind(cell)
+    cells << cell
+  end
+  status = FLTK3::Cell.new("idle")
+  FLTK3::Button.new(10, 410, 400, 25).bind(status, "status: %s")
+  cells << status
+end
+window.show
+
+# Writes are cheap; the widgets only repaint at the refresh rate.
+10000.times {|n| cells[n % 100].value = n }
+cells.last.value = "done"
+
+FLTK3::run
@@ -0,0 +1,20 @@
+#!mruby
+
+window = FLTK3::Window.new(100, 100, 400, 430, "mruby-fltk3")
+window.begin do
+  input = FLTK3::Input.new(60, 10, 330, 25, "filter")
+  browser = FLTK3::Browser.new(10, 45, 380, 375)
+  100000.times {|i| browser.add "line #{i}" }
+  input.callback do
+    if input.value.empty?
+      browser.filter_clear
+    else
+      browser.filter input.value, true
+    end
+    browser.redraw
+  end
+  window.resizable = browser
+end
+window.show
+
+FLTK3::run
@@ -0,0 +1,32 @@
+#!mruby
+
+window = FLTK3::Window.new(100, 100, 400, 300, "mruby-fltk3")
+window.begin do
+  flex = FLTK3::Flex.new(0, 0, 400, 300)
+  flex.direction = :column
+  flex.margin = 5
+  flex.gap = 5
+  flex.begin do
+    toolbar = FLTK3::Flex.new(0, 0, 400, 30)
+    toolbar.gap = 5
+    toolbar.begin do
+      5.times {|i| FLTK3::Button.new(0, 0, 0, 0, "Tool #{i}") }
+    end
+    flex.set toolbar, 0, 30
+
+    grid = FLTK3::Grid.new(0, 0, 400, 260)
+    grid.rows = 3
+    grid.cols = 3
+    grid.gap = 5
+    grid.col_weights = [1, 2, 1]
+    grid.begin do
+      grid.place FLTK3::Button.new(0, 0, 0, 0, "header"), 0, 0, 1, 3
+      grid.place FLTK3::Button.new(0, 0, 0, 0, "side"), 1, 0, 2, 1
+      grid.place FLTK3::Button.new(0, 0, 0, 0, "body"), 1, 1, 2, 2
+    end
+  end
+  window.resizable = flex
+end
+window.show
+
+FLTK3::run
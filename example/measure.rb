@@ -0,0 +1,20 @@
+#!mruby
+
+FLTK3.set_fonts("-*")
+FLTK3.fonts.select {|f| f[:bold] }.each {|f| puts "#{f[:index]}: #{f[:name]}" }
+
+window = FLTK3::Window.new(100, 100, 600, 400, "mruby-fltk3")
+window.begin do
+  browser = FLTK3::Browser.new(10, 10, 580, 380)
+  rows = (0...100000).map {|i| ["item #{i}", "#{i * 37 % 1000} units", "row #{i}"] }
+  widths = [0, 0, 0]
+  3.times do |c|
+    m = FLTK3.measure(rows.map {|r| r[c] }, 0, 14)
+    0.step(m.size - 1, 2) {|i| widths[c] = m[i] if m[i] > widths[c] }
+  end
+  browser.column_widths = widths.map {|w| w + 10 }
+  rows.each {|r| browser.add r.join("\t") }
+end
+window.show
+
+FLTK3::run
@@ -0,0 +1,21 @@
+#!mruby
+
+window = FLTK3::Window.new(100, 100, 400, 200, "mruby-fltk3")
+window.begin do
+  bar = FLTK3::MenuBar.new(0, 0, 400, 25)
+  recent = (1..200).map {|i| ["file#{i}.rb", 0, 0, Proc.new {|w, label| puts "open #{label}" }] }
+  bar.menu = [
+    ["File", 0, 0, nil, [
+      ["New", FLTK3::CTRL + "n".ord, 0, Proc.new { puts "new" }],
+      ["Recent", 0, FLTK3::MENU_DIVIDER, nil, recent],
+      ["Quit", FLTK3::CTRL + "q".ord, 0, Proc.new { window.hide }],
+    ]],
+    ["View", 0, 0, nil, [
+      ["Wrap", 0, FLTK3::MENU_TOGGLE, Proc.new {|w, label| puts "toggled #{label}" }],
+    ]],
+  ]
+  bar.add("Help/About") { puts "mruby-fltk3" }
+end
+window.show
+
+FLTK3::run
@@ -0,0 +1,26 @@
+#!mruby
+
+# Record a session with `mruby replay.rb record`, then play it back with
+# `xvfb-run mruby replay.rb`. Windows must be created in the same order.
+w = FLTK3::Window.new(100, 100, 200, 100, "mruby-fltk3")
+w.begin
+  count = 0
+  b = FLTK3::Button.new(10, 10, 180, 80, "Click Me!")
+  b.callback do
+    count += 1
+  end
+w.end
+w.show
+
+if ARGV[0] == "record"
+  FLTK3::record "session.flr"
+  FLTK3::run
+  FLTK3::record_stop
+else
+  10.times do
+    FLTK3::simulate b, :push
+    FLTK3::simulate b, :release
+  end
+  p FLTK3::replay("session.flr", true)
+  p count
+end
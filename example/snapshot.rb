@@ -0,0 +1,17 @@
+#!mruby
+
+# Run under Xvfb: xvfb-run mruby snapshot.rb
+window = FLTK3::Window.new(100, 100, 200, 100, "mruby-fltk3")
+window.begin
+  button = FLTK3::Button.new(10, 10, 180, 80, "Snapshot")
+window.end
+window.show
+FLTK3::check
+
+before = window.render_to_image
+puts "window: #{FLTK3::render_usec} usec, #{before.phash}"
+button.label = "Changed"
+after = window.render_to_image
+puts "diff: #{before.diff(after)}"
+thumb = button.render_to_image(0.5)
+puts "button: #{FLTK3::render_usec} usec, #{thumb.w}x#{thumb.h}, #{thumb.data.size} bytes"
@@ -0,0 +1,10 @@
+#!mruby
+
+# Build with -DMRB_FLTK3_EAGER_INIT to compare against eager class definition.
+puts "init: #{FLTK3::init_usec} usec"
+FLTK3::Button
+FLTK3::Browser
+FLTK3::TextEditor
+FLTK3::UpBox
+FLTK3::Image
+puts "init with all class groups: #{FLTK3::init_usec} usec"
@@ -0,0 +1,15 @@
+#!mruby
+
+window = FLTK3::Window.new(100, 100, 400, 130, "mruby-fltk3")
+window.begin do
+  amount = FLTK3::Input.new(80, 10, 310, 25, "amount")
+  amount.filter = :float
+  amount.max_length = 12
+  code = FLTK3::Input.new(80, 45, 310, 25, "code")
+  code.pattern = "^[A-Z]{0,3}[0-9]{0,4}$"
+  output = FLTK3::Input.new(80, 80, 310, 25, "echo")
+  amount.on_change(150, 250) {|w, value| output.value = value }
+end
+window.show
+
+FLTK3::run
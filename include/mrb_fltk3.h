@@ -0,0 +1,28 @@
+#ifndef MRB_FLTK3_H
+#define MRB_FLTK3_H
+
+#include <stddef.h>
+#include <mruby.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Native side of FLTK3::Cell. Setters may be called from any thread; bound
+ * widgets pick up the new value on the next refresh of the event loop. */
+typedef struct mrb_fltk3_cell mrb_fltk3_cell;
+
+/* Returns the cell behind a FLTK3::Cell with an extra reference held, so it
+ * stays valid after the Ruby object is collected. */
+mrb_fltk3_cell* mrb_fltk3_cell_get(mrb_state* mrb, mrb_value cell);
+void mrb_fltk3_cell_retain(mrb_fltk3_cell* cell);
+void mrb_fltk3_cell_release(mrb_fltk3_cell* cell);
+
+void mrb_fltk3_cell_set_number(mrb_fltk3_cell* cell, double v);
+void mrb_fltk3_cell_set_string(mrb_fltk3_cell* cell, const char* s, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,11 @@
 #include <mruby/hash.h>
 #include <mruby/class.h>
 #include <mruby/variable.h>
+#if defined(MRUBY_RELEASE_NO) && MRUBY_RELEASE_NO >= 10200
+#include <mruby/throw.h>
+#else
+#include <setjmp.h>
+#endif
 #include <fltk3/Box.h>
 #include <fltk3/Browser.h>
 #include <fltk3/Button.h>
@@ -37,7 +42,26 @@
 #include <fltk3/message.h>
 #include <fltk3/ask.h>
 #include <fltk3/run.h>
+#include <fltk3/draw.h>
+#include <fltk3/RGBImage.h>
+#include <fltk3/x.h>
+#include "mrb_fltk3.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#ifndef _WIN32
+#define MRB_FLTK3_USE_REGEX
+#include <regex.h>
+#endif
 
 #if 1
 #define ARENA_SAVE \
@@ -94,22 +118,349 @@ arg_check(const char* t, int argc, mrb_value* argv)
     value_context = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "context")); \
     Data_Get_Struct(mrb, value_context, &fltk3_ ## t ## _type, context);
 
+static double
+mrb_fltk3_now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 /*********************************************************
- * FLTK3::Widget
+ * String pool
+ *********************************************************/
+/* fltk3 keeps the pointers given to label() and Input::value() instead of
+ * copying them, so strings handed over from mruby are interned here. Equal
+ * strings share one entry, which lives until its last reference is released. */
+typedef std::unordered_map<std::string, int> mrb_fltk3_string_pool;
+
+static mrb_fltk3_string_pool&
+string_pool()
+{
+  static mrb_fltk3_string_pool* pool = new mrb_fltk3_string_pool;
+  return *pool;
+}
+
+static const char*
+mrb_fltk3_str_intern(const char* s, size_t len)
+{
+  std::pair<mrb_fltk3_string_pool::iterator, bool> r =
+    string_pool().insert(std::make_pair(std::string(s, len), 0));
+  r.first->second++;
+  return r.first->first.c_str();
+}
+
+static void
+mrb_fltk3_str_release(const char* s)
+{
+  if (!s) return;
+  mrb_fltk3_string_pool::iterator it = string_pool().find(s);
+  if (it == string_pool().end() || it->first.c_str() != s) return;
+  if (--it->second == 0) string_pool().erase(it);
+}
+
+enum {
+  MRB_FLTK3_STR_label,
+  MRB_FLTK3_STR_MAX
+};
+
+/*********************************************************
+ * Event recording
+ *********************************************************/
+/* Recorded sessions are a "FLR1" header followed by fixed size records, each
+ * optionally followed by text_len bytes of event text. */
+typedef struct {
+  uint8_t event;
+  uint8_t window;
+  uint8_t text_len;
+  uint8_t clicks;
+  uint32_t usec;
+  int16_t x, y;
+  int16_t dx, dy;
+  uint32_t state;
+  uint32_t key;
+} mrb_fltk3_event_entry;
+
+static FILE* event_recorder = NULL;
+static double event_recorder_last = 0;
+static int event_recorder_count = 0;
+static int callback_count = 0;
+static int event_synthetic = 0;
+
+/* Windows created from mruby, in creation order; a window's index is its id in
+ * recorded sessions. */
+static std::vector<fltk3::Window*>&
+event_windows()
+{
+  static std::vector<fltk3::Window*>* windows = new std::vector<fltk3::Window*>;
+  return *windows;
+}
+
+static void
+mrb_fltk3_event_window_remove(fltk3::Widget* w)
+{
+  std::vector<fltk3::Window*>& windows = event_windows();
+  std::replace(windows.begin(), windows.end(), (fltk3::Window*) w, (fltk3::Window*) NULL);
+}
+
+static void
+mrb_fltk3_event_record(fltk3::Widget* w, int e)
+{
+  if (!event_recorder) return;
+  switch (e) {
+  case fltk3::PUSH: case fltk3::RELEASE: case fltk3::DRAG: case fltk3::MOVE:
+  case fltk3::KEYDOWN: case fltk3::KEYUP: case fltk3::MOUSEWHEEL:
+    break;
+  default:
+    return;
+  }
+  fltk3::Window* win = dynamic_cast<fltk3::Window*>(w);
+  if (!win) win = w->window();
+  std::vector<fltk3::Window*>& windows = event_windows();
+  std::vector<fltk3::Window*>::iterator it = std::find(windows.begin(), windows.end(), win);
+  if (!win || it == windows.end() || it - windows.begin() > 255) return;
+
+  double now = mrb_fltk3_now();
+  const char* text = fltk3::event_text();
+  int text_len = text ? fltk3::event_length() : 0;
+  if (text_len > 255) text_len = 255;
+  mrb_fltk3_event_entry r;
+  r.event = (uint8_t) e;
+  r.window = (uint8_t) (it - windows.begin());
+  r.text_len = (uint8_t) text_len;
+  r.clicks = (uint8_t) fltk3::event_clicks();
+  r.usec = (uint32_t) ((now - event_recorder_last) * 1000000.0);
+  r.x = (int16_t) fltk3::event_x();
+  r.y = (int16_t) fltk3::event_y();
+  r.dx = (int16_t) fltk3::event_dx();
+  r.dy = (int16_t) fltk3::event_dy();
+  r.state = (uint32_t) fltk3::event_state();
+  r.key = (uint32_t) fltk3::event_key();
+  fwrite(&r, sizeof(r), 1, event_recorder);
+  if (text_len) fwrite(text, 1, text_len, event_recorder);
+  event_recorder_last = now;
+  event_recorder_count++;
+}
+
+/*********************************************************
+ * Idle GC
  *********************************************************/
+/* Changing GC.interval_ratio only takes effect when the next cycle ends, so
+ * collection is switched off outright (as GC.disable does)
+ * while the user is dragging or typing. If the heap doubles during input a
+ * single GC step is let through from the frame timeout and timed as an input
+ * pause. Once input has been quiet for a moment, the cycle is finished from
+ * the timeout in slices of at most gc_budget usec, stopped early when events
+ * are pending. In generational mode one step is a whole minor collection,
+ * which can't be split, so those ticks run exactly one step each. */
+/* mruby 1.2 moved the collector state from mrb_state into mrb->gc. */
+#if defined(MRUBY_RELEASE_NO) && MRUBY_RELEASE_NO >= 10200
+#define MRB_FLTK3_GC_IDLE(mrb) ((mrb)->gc.state == MRB_GC_STATE_ROOT)
+#define MRB_FLTK3_GC_LIVE(mrb) ((mrb)->gc.live)
+#define MRB_FLTK3_GC_DISABLED(mrb) ((mrb)->gc.disabled)
+#define MRB_FLTK3_GC_GENERATIONAL(mrb) ((mrb)->gc.generational)
+#else
+#define MRB_FLTK3_GC_IDLE(mrb) ((mrb)->gc_state == GC_STATE_NONE)
+#define MRB_FLTK3_GC_LIVE(mrb) ((mrb)->live)
+#define MRB_FLTK3_GC_DISABLED(mrb) ((mrb)->gc_disabled)
+#define MRB_FLTK3_GC_GENERATIONAL(mrb) ((mrb)->is_generational_gc_mode)
+#endif
+#define MRB_FLTK3_GC_TICK (1.0 / 60)
+#define MRB_FLTK3_GC_QUIET 0.1
+#define MRB_FLTK3_GC_BUCKETS 8
+#define MRB_FLTK3_GC_HEADROOM 10000
+
+static struct {
+  mrb_state* mrb;
+  bool enabled;
+  bool input;
+  bool pending;
+  int budget_usec;
+  double last_input;
+  bool disabled;
+  size_t live_cap;
+  int slices;
+  int deferred;
+  int histogram[MRB_FLTK3_GC_BUCKETS];
+  int input_pauses;
+  int input_max_usec;
+  int input_histogram[MRB_FLTK3_GC_BUCKETS];
+} gc_sched = { NULL, true, false, false, 2000, 0, false, 0, 0, 0, {0}, 0, 0, {0} };
+
+static void
+gc_histogram_add(int* histogram, int usec)
+{
+  int bucket = 0;
+  while (bucket < MRB_FLTK3_GC_BUCKETS - 1 && usec >= (250 << bucket)) bucket++;
+  histogram[bucket]++;
+}
+
+static void
+mrb_fltk3_gc_restore(mrb_state* mrb)
+{
+  MRB_FLTK3_GC_DISABLED(mrb) = gc_sched.disabled;
+  gc_sched.input = false;
+}
+
+// The one collection step allowed while input is active.
+static void
+mrb_fltk3_gc_input_step(mrb_state* mrb)
+{
+  double start = mrb_fltk3_now();
+  MRB_FLTK3_GC_DISABLED(mrb) = false;
+  mrb_incremental_gc(mrb);
+  MRB_FLTK3_GC_DISABLED(mrb) = true;
+  int usec = (int) ((mrb_fltk3_now() - start) * 1000000.0);
+  gc_histogram_add(gc_sched.input_histogram, usec);
+  gc_sched.input_pauses++;
+  if (usec > gc_sched.input_max_usec) gc_sched.input_max_usec = usec;
+  if (MRB_FLTK3_GC_IDLE(mrb))
+    gc_sched.live_cap = MRB_FLTK3_GC_LIVE(mrb) * 2 + MRB_FLTK3_GC_HEADROOM;
+}
+
+static void
+mrb_fltk3_gc_tick(void* data)
+{
+  mrb_state* mrb = gc_sched.mrb;
+  double now = mrb_fltk3_now();
+  if (gc_sched.input) {
+    if (now - gc_sched.last_input < MRB_FLTK3_GC_QUIET) {
+      if (!gc_sched.disabled && MRB_FLTK3_GC_LIVE(mrb) > gc_sched.live_cap) mrb_fltk3_gc_input_step(mrb);
+      fltk3::repeat_timeout(MRB_FLTK3_GC_TICK, mrb_fltk3_gc_tick);
+      return;
+    }
+    mrb_fltk3_gc_restore(mrb);
+    gc_sched.pending = true;
+  }
+  if (!gc_sched.pending) return;
+  // Left to the script after GC.disable.
+  if (MRB_FLTK3_GC_DISABLED(mrb)) {
+    gc_sched.pending = false;
+    return;
+  }
+
+  do {
+    mrb_incremental_gc(mrb);
+  } while (!MRB_FLTK3_GC_GENERATIONAL(mrb) &&
+    !MRB_FLTK3_GC_IDLE(mrb) && !fltk3::ready() &&
+    (mrb_fltk3_now() - now) * 1000000.0 < gc_sched.budget_usec);
+
+  gc_histogram_add(gc_sched.histogram, (int) ((mrb_fltk3_now() - now) * 1000000.0));
+  gc_sched.slices++;
+  if (MRB_FLTK3_GC_IDLE(mrb))
+    gc_sched.pending = false;
+  else
+    fltk3::repeat_timeout(MRB_FLTK3_GC_TICK, mrb_fltk3_gc_tick);
+}
+
+static void
+mrb_fltk3_gc_input(int e)
+{
+  if (!gc_sched.mrb || !gc_sched.enabled) return;
+  switch (e) {
+  case fltk3::PUSH: case fltk3::DRAG: case fltk3::KEYDOWN: case fltk3::MOUSEWHEEL:
+    break;
+  default:
+    return;
+  }
+  gc_sched.last_input = mrb_fltk3_now();
+  if (gc_sched.input) return;
+  mrb_state* mrb = gc_sched.mrb;
+  gc_sched.disabled = MRB_FLTK3_GC_DISABLED(mrb);
+  gc_sched.live_cap = MRB_FLTK3_GC_LIVE(mrb) * 2 + MRB_FLTK3_GC_HEADROOM;
+  MRB_FLTK3_GC_DISABLED(mrb) = true;
+  gc_sched.input = true;
+  gc_sched.deferred++;
+  fltk3::remove_timeout(mrb_fltk3_gc_tick);
+  fltk3::add_timeout(MRB_FLTK3_GC_TICK, mrb_fltk3_gc_tick);
+}
+
+/* Installed as fltk3's event dispatch, so an event is seen once when fltk3
+ * takes it from the system, however many widgets it is later offered to on
+ * its way up the focus chain and through shortcut handling. */
+static int
+mrb_fltk3_event_hook(int e, fltk3::Window* w)
+{
+  // Events sent by FLTK3.simulate and FLTK3.replay are neither recorded
+  // again nor treated as user input.
+  if (!event_synthetic) {
+    if (w) mrb_fltk3_event_record(w, e);
+    mrb_fltk3_gc_input(e);
+  }
+  return fltk3::handle_(e, w);
+}
+
+/* Mixed into every widget created from mruby, so the pooled strings it
+ * references are released when fltk3 deletes the widget. */
+class mrb_fltk3_refs {
+public:
+  const char* strs[MRB_FLTK3_STR_MAX];
+  mrb_fltk3_refs() { memset(strs, 0, sizeof(strs)); }
+  virtual ~mrb_fltk3_refs() {
+    for (int n = 0; n < MRB_FLTK3_STR_MAX; n++)
+      mrb_fltk3_str_release(strs[n]);
+  }
+  void ref(int slot, const char* s) {
+    mrb_fltk3_str_release(strs[slot]);
+    strs[slot] = s;
+  }
+};
+
+static void mrb_fltk3_cell_unbind(fltk3::Widget* w);
+
+template <class T>
+class mrb_fltk3_owned : public mrb_fltk3_refs, public T {
+public:
+  template <typename... A>
+  mrb_fltk3_owned(A... a) : T(a...) {}
+  virtual ~mrb_fltk3_owned() {
+    mrb_fltk3_event_window_remove(this);
+    mrb_fltk3_cell_unbind(this);
+  }
+};
+
+static const char*
+mrb_fltk3_str_ref(fltk3::Widget* w, int slot, mrb_value s)
+{
+  const char* p = mrb_fltk3_str_intern(RSTRING_PTR(s), RSTRING_LEN(s));
+  mrb_fltk3_refs* refs = dynamic_cast<mrb_fltk3_refs*>(w);
+  if (refs) refs->ref(slot, p);
+  return p;
+}
+
+/* Pooled strings never change, so the mruby string made for one is kept on
+ * the wrapper and handed out again until the widget points elsewhere. A freed
+ * pool node's address can come back for different text, and native code
+ * (cell bindings) swaps labels without seeing the wrapper, so the contents
+ * are compared as well as the pointer. That is only safe where the string
+ * can be frozen (mruby with MRB_SET_FROZEN_FLAG); otherwise every call gets
+ * its own copy. */
 static mrb_value
-mrb_fltk3_widget_box_get(mrb_state *mrb, mrb_value self)
+mrb_fltk3_str_cached(mrb_state* mrb, mrb_value self, fltk3::Widget* w, int slot, mrb_sym ptr_sym, mrb_sym str_sym, const char* vv)
 {
-  CONTEXT_SETUP(Widget);
-  struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
-  struct RClass* _class_fltk3_Box = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Box")));
-  mrb_value args[1];
-  args[0] = mrb_obj_value(
-    Data_Wrap_Struct(mrb, mrb->object_class,
-    &fltk3_Widget_type, (void*) context->v->box()));
-  return mrb_class_new_instance(mrb, 1, args, _class_fltk3_Box);
+  if (!vv) return mrb_nil_value();
+#ifdef MRB_SET_FROZEN_FLAG
+  mrb_fltk3_refs* refs = dynamic_cast<mrb_fltk3_refs*>(w);
+  if (!refs || refs->strs[slot] != vv) return mrb_str_new_cstr(mrb, vv);
+  mrb_value ptr = mrb_iv_get(mrb, self, ptr_sym);
+  if (mrb_cptr_p(ptr) && mrb_cptr(ptr) == (void*) vv) {
+    mrb_value str = mrb_iv_get(mrb, self, str_sym);
+    size_t len = RSTRING_LEN(str);
+    if (!strncmp(RSTRING_PTR(str), vv, len) && !vv[len]) return str;
+  }
+  mrb_value str = mrb_str_new_cstr(mrb, vv);
+  MRB_SET_FROZEN_FLAG(mrb_basic_ptr(str));
+  mrb_iv_set(mrb, self, ptr_sym, mrb_cptr_value(mrb, (void*) vv));
+  mrb_iv_set(mrb, self, str_sym, str);
+  return str;
+#else
+  return mrb_str_new_cstr(mrb, vv);
+#endif
 }
 
+/*********************************************************
+ * FLTK3::Widget
+ *********************************************************/
 static mrb_value
 mrb_fltk3_widget_box_set(mrb_state *mrb, mrb_value self)
 {
@@ -154,6 +505,8 @@ mrb_fltk3_widget_image_set(mrb_state *mrb, mrb_value self)
     context->v->image((fltk3::Image*) image_context->v);
   } else
     context->v->image(NULL);
+  // Keeps an owned image alive while the widget draws it.
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "image"), image);
   return mrb_nil_value();
 }
 
@@ -190,6 +543,7 @@ _mrb_fltk3_widget_callback(fltk3::Widget* v, void* data)
   mrb_value value = mrb_iv_get(mrb, context->instance, mrb_intern_lit(mrb, "value"));
   args[0] = context->instance;
   args[1] = value;
+  callback_count++;
   mrb_yield_argv(mrb, proc, 2, args);
 }
 
@@ -217,118 +571,1819 @@ mrb_fltk3_window_show(mrb_state *mrb, mrb_value self)
 }
 
 /*********************************************************
- * FLTK3::Group
+ * Regular expressions
  *********************************************************/
-static mrb_value
-mrb_fltk3_group_begin(mrb_state *mrb, mrb_value self)
+#ifdef MRB_FLTK3_USE_REGEX
+static void
+regex_unsupported(mrb_state* mrb, const char* what)
 {
-  CONTEXT_SETUP(Widget);
-  mrb_value b = mrb_nil_value();
-  mrb_get_args(mrb, "&", &b);
-  if (!mrb_nil_p(b)) {
-    mrb_value args[1];
-    args[0] = self;
-    ((fltk3::Group*)context->v)->begin();
-    mrb_yield_argv(mrb, b, 1, args);
-    ((fltk3::Group*)context->v)->end();
-  } else
-    ((fltk3::Group*)context->v)->begin();
-  return mrb_nil_value();
+  std::string msg = std::string(what) + " is not supported in regular expressions";
+  mrb_raise(mrb, E_ARGUMENT_ERROR, msg.c_str());
+}
+
+/* Rewrites Ruby regexp syntax into POSIX extended syntax. The common escapes
+ * have direct equivalents; anything POSIX can't express is rejected instead
+ * of quietly matching something else. */
+static void
+regex_translate(mrb_state* mrb, const std::string& src, bool extended, std::string& out)
+{
+  bool bracket = false;
+  size_t n = src.size();
+  for (size_t i = 0; i < n; i++) {
+    char c = src[i];
+    if (c == '\\' && i + 1 < n) {
+      char e = src[++i];
+      const char* sub = NULL;
+      switch (e) {
+      case 'd': sub = bracket ? "0-9" : "[0-9]"; break;
+      case 'w': sub = bracket ? "A-Za-z0-9_" : "[A-Za-z0-9_]"; break;
+      case 's': sub = bracket ? "[:space:]" : "[[:space:]]"; break;
+      case 'h': sub = bracket ? "0-9A-Fa-f" : "[0-9A-Fa-f]"; break;
+      case 'D': sub = bracket ? NULL : "[^0-9]"; break;
+      case 'W': sub = bracket ? NULL : "[^A-Za-z0-9_]"; break;
+      case 'S': sub = bracket ? NULL : "[^[:space:]]"; break;
+      case 'H': sub = bracket ? NULL : "[^0-9A-Fa-f]"; break;
+      case 'A': sub = bracket ? NULL : "^"; break;
+      case 'z': case 'Z': sub = bracket ? NULL : "$"; break;
+      case 'n': sub = "\n"; break;
+      case 't': sub = "\t"; break;
+      }
+      if (sub) {
+        out += sub;
+      } else if (isalnum((unsigned char) e) || (bracket && strchr("]^-", e))) {
+        std::string what = std::string("\\") + e;
+        regex_unsupported(mrb, what.c_str());
+      } else if (bracket) {
+        out += e;
+      } else {
+        out += '\\';
+        out += e;
+      }
+      continue;
+    }
+    if (bracket) {
+      if (c == '[' && i + 1 < n && src[i + 1] == ':') {
+        size_t end = src.find(":]", i + 2);
+        if (end == std::string::npos) regex_unsupported(mrb, "an unterminated character class");
+        out.append(src, i, end + 2 - i);
+        i = end + 1;
+        continue;
+      }
+      if (c == '[') regex_unsupported(mrb, "a nested character class");
+      if (c == ']') bracket = false;
+      out += c;
+      continue;
+    }
+    if (extended && isspace((unsigned char) c)) continue;
+    if (extended && c == '#') {
+      while (i + 1 < n && src[i + 1] != '\n') i++;
+      continue;
+    }
+    if (c == '[') {
+      bracket = true;
+      out += c;
+      if (i + 1 < n && src[i + 1] == '^') out += src[++i];
+      if (i + 1 < n && src[i + 1] == ']') out += src[++i];
+      continue;
+    }
+    if (c == '(' && i + 1 < n && src[i + 1] == '?')
+      regex_unsupported(mrb, "(?...)");
+    if (strchr("*+?}", c) && i + 1 < n && (src[i + 1] == '?' || src[i + 1] == '+'))
+      regex_unsupported(mrb, "a lazy or possessive quantifier");
+    out += c;
+  }
+}
+
+/* A String is taken as a POSIX extended regular expression as it is. A Regexp
+ * is translated from Ruby syntax, and its /i and /x options are honoured. */
+static void
+mrb_fltk3_regex_compile(mrb_state* mrb, regex_t* re, mrb_value pattern, bool icase)
+{
+  std::string source;
+  if (mrb_type(pattern) == MRB_TT_STRING) {
+    source.assign(RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+  } else {
+    mrb_value src = mrb_funcall(mrb, pattern, "source", 0);
+    mrb_value options = mrb_funcall(mrb, pattern, "options", 0);
+    if (mrb_type(src) != MRB_TT_STRING)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "pattern must be a String or a Regexp");
+    int opts = mrb_fixnum_p(options) ? mrb_fixnum(options) : 0;
+    if (opts & 1) icase = true;
+    regex_translate(mrb, std::string(RSTRING_PTR(src), RSTRING_LEN(src)), (opts & 2) != 0, source);
+  }
+  int flags = REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0);
+  if (regcomp(re, source.c_str(), flags) != 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid regular expression");
+}
+#endif
+
+/*********************************************************
+ * FLTK3::Input
+ *********************************************************/
+/* Native callbacks reach Ruby through a wrapper's context and ivars, so a
+ * widget holding on to its context keeps the wrapper reachable from the
+ * FLTK3 "roots" ivar until it lets go or is destroyed. */
+static void
+mrb_fltk3_root(mrb_fltk3_Widget_context* context)
+{
+  mrb_state* mrb = context->mrb;
+  mrb_value module = mrb_obj_value(mrb_class_get(mrb, "FLTK3"));
+  mrb_sym sym = mrb_intern_lit(mrb, "roots");
+  mrb_value roots = mrb_iv_get(mrb, module, sym);
+  if (mrb_nil_p(roots)) {
+    roots = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, module, sym, roots);
+  }
+  mrb_ary_push(mrb, roots, context->instance);
+}
+
+static void
+mrb_fltk3_unroot(mrb_fltk3_Widget_context* context)
+{
+  mrb_state* mrb = context->mrb;
+  mrb_value module = mrb_obj_value(mrb_class_get(mrb, "FLTK3"));
+  mrb_value roots = mrb_iv_get(mrb, module, mrb_intern_lit(mrb, "roots"));
+  if (mrb_nil_p(roots)) return;
+  int n = RARRAY_LEN(roots);
+  for (int i = 0; i < n; i++) {
+    if (mrb_obj_ptr(RARRAY_PTR(roots)[i]) != mrb_obj_ptr(context->instance)) continue;
+    mrb_ary_set(mrb, roots, i, RARRAY_PTR(roots)[n - 1]);
+    mrb_ary_pop(mrb, roots);
+    return;
+  }
+}
+
+enum {
+  MRB_FLTK3_FILTER_NONE,
+  MRB_FLTK3_FILTER_INTEGER,
+  MRB_FLTK3_FILTER_FLOAT,
+  MRB_FLTK3_FILTER_HEX
+};
+
+/* Rejects keystrokes and pastes natively when the resulting text would not
+ * pass the filter, and coalesces change notifications so Ruby sees at most
+ * one per debounce/throttle interval, always with the latest value. */
+class mrb_fltk3_input : public fltk3::Input {
+public:
+  int filter;
+  int max_length;
+#ifdef MRB_FLTK3_USE_REGEX
+  bool has_pattern;
+  regex_t pattern;
+#endif
+  mrb_fltk3_Widget_context* notify;
+  double debounce, throttle, last_delivery;
+
+  mrb_fltk3_input(int x, int y, int w, int h, const char* l = 0)
+    : fltk3::Input(x, y, w, h, l), filter(MRB_FLTK3_FILTER_NONE), max_length(0),
+#ifdef MRB_FLTK3_USE_REGEX
+      has_pattern(false),
+#endif
+      notify(NULL), debounce(0), throttle(0), last_delivery(0) {}
+  virtual ~mrb_fltk3_input() {
+    fltk3::remove_timeout(deliver, this);
+    if (notify) mrb_fltk3_unroot(notify);
+    clear_pattern();
+  }
+
+  void clear_pattern() {
+#ifdef MRB_FLTK3_USE_REGEX
+    if (has_pattern) regfree(&pattern);
+    has_pattern = false;
+#endif
+  }
+
+  bool accept(const std::string& s) const {
+    if (max_length > 0 && (int) s.size() > max_length) return false;
+    size_t i = 0, n = s.size();
+    switch (filter) {
+    case MRB_FLTK3_FILTER_INTEGER:
+      if (i < n && (s[i] == '-' || s[i] == '+')) i++;
+      while (i < n && isdigit((unsigned char) s[i])) i++;
+      if (i != n) return false;
+      break;
+    case MRB_FLTK3_FILTER_FLOAT: {
+      bool digits = false;
+      if (i < n && (s[i] == '-' || s[i] == '+')) i++;
+      for (; i < n && isdigit((unsigned char) s[i]); i++) digits = true;
+      if (i < n && s[i] == '.') i++;
+      for (; i < n && isdigit((unsigned char) s[i]); i++) digits = true;
+      // An exponent needs a mantissa digit before it.
+      if (digits && i < n && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if (i < n && (s[i] == '-' || s[i] == '+')) i++;
+        while (i < n && isdigit((unsigned char) s[i])) i++;
+      }
+      if (i != n) return false;
+      break;
+    }
+    case MRB_FLTK3_FILTER_HEX:
+      if (n >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) i = 2;
+      while (i < n && isxdigit((unsigned char) s[i])) i++;
+      if (i != n) return false;
+      break;
+    }
+#ifdef MRB_FLTK3_USE_REGEX
+    if (has_pattern && regexec(&pattern, s.c_str(), 0, NULL, 0) != 0) return false;
+#endif
+    return true;
+  }
+
+  virtual int handle(int e) {
+    if (e == fltk3::KEYBOARD || e == fltk3::PASTE) {
+      const char* text = fltk3::event_text();
+      int len = fltk3::event_length();
+      bool insert = len > 0 && (e == fltk3::PASTE ||
+        (!(fltk3::event_state() & (fltk3::CTRL | fltk3::ALT | fltk3::META)) &&
+         (unsigned char) text[0] >= 0x20 && text[0] != 0x7f));
+      if (insert) {
+        int a = std::min(position(), mark()), b = std::max(position(), mark());
+        std::string next(value(), a);
+        next.append(text, len);
+        next.append(value() + b, size() - b);
+        if (!accept(next)) return 1;
+      }
+    }
+    return fltk3::Input::handle(e);
+  }
+
+  static void deliver(void* data) {
+    mrb_fltk3_input* input = (mrb_fltk3_input*) data;
+    mrb_fltk3_Widget_context* context = input->notify;
+    if (!context) return;
+    input->last_delivery = mrb_fltk3_now();
+    mrb_state* mrb = context->mrb;
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value args[2];
+    args[0] = context->instance;
+    args[1] = mrb_str_new_cstr(mrb, input->value());
+    mrb_value proc = mrb_iv_get(mrb, context->instance, mrb_intern_lit(mrb, "on_change"));
+    callback_count++;
+    mrb_yield_argv(mrb, proc, 2, args);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  static void changed(fltk3::Widget* w, void* data) {
+    mrb_fltk3_input* input = (mrb_fltk3_input*) data;
+    double now = mrb_fltk3_now();
+    double due = now + input->debounce;
+    if (input->throttle > 0 && due < input->last_delivery + input->throttle)
+      due = input->last_delivery + input->throttle;
+    fltk3::remove_timeout(deliver, input);
+    if (due <= now)
+      deliver(input);
+    else
+      fltk3::add_timeout(due - now, deliver, input);
+  }
+};
+
+static mrb_fltk3_input*
+input_arg(mrb_state *mrb, fltk3::Widget* w)
+{
+  mrb_fltk3_input* input = dynamic_cast<mrb_fltk3_input*>(w);
+  if (!input) mrb_raise(mrb, E_ARGUMENT_ERROR, "not an input created from mruby");
+  return input;
 }
 
 static mrb_value
-mrb_fltk3_group_end(mrb_state *mrb, mrb_value self)
+mrb_fltk3_input_filter_set(mrb_state *mrb, mrb_value self)
 {
   CONTEXT_SETUP(Widget);
-  ((fltk3::Group*)context->v)->end();
+  mrb_value filter;
+  mrb_get_args(mrb, "o", &filter);
+  mrb_fltk3_input* input = input_arg(mrb, context->v);
+  if (mrb_nil_p(filter)) {
+    input->filter = MRB_FLTK3_FILTER_NONE;
+    return mrb_nil_value();
+  }
+  if (mrb_type(filter) != MRB_TT_SYMBOL) mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid filter");
+  const char* name = mrb_sym2name(mrb, mrb_symbol(filter));
+  if (!strcmp(name, "integer")) input->filter = MRB_FLTK3_FILTER_INTEGER;
+  else if (!strcmp(name, "float")) input->filter = MRB_FLTK3_FILTER_FLOAT;
+  else if (!strcmp(name, "hex")) input->filter = MRB_FLTK3_FILTER_HEX;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "filter must be :integer, :float, :hex or nil");
   return mrb_nil_value();
 }
 
 static mrb_value
-mrb_fltk3_group_resizable_get(mrb_state *mrb, mrb_value self)
+mrb_fltk3_input_pattern_set(mrb_state *mrb, mrb_value self)
 {
   CONTEXT_SETUP(Widget);
-  struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
-  struct RClass* _class_fltk3_Widget = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Widget")));
-  mrb_value args[1];
-  args[0] = mrb_obj_value(
-    Data_Wrap_Struct(mrb, mrb->object_class,
-    &fltk3_Widget_type, (void*) ((fltk3::Group*) context->v)->resizable()));
-  return mrb_class_new_instance(mrb, 1, args, _class_fltk3_Widget);
+  mrb_value pattern;
+  mrb_get_args(mrb, "o", &pattern);
+  mrb_fltk3_input* input = input_arg(mrb, context->v);
+  input->clear_pattern();
+  if (mrb_nil_p(pattern)) return mrb_nil_value();
+#ifdef MRB_FLTK3_USE_REGEX
+  mrb_fltk3_regex_compile(mrb, &input->pattern, pattern, false);
+  input->has_pattern = true;
+#else
+  mrb_raise(mrb, E_RUNTIME_ERROR, "regular expressions are not supported");
+#endif
+  return mrb_nil_value();
 }
 
 static mrb_value
-mrb_fltk3_group_resizable_set(mrb_state *mrb, mrb_value self)
+mrb_fltk3_input_on_change(mrb_state *mrb, mrb_value self)
 {
   CONTEXT_SETUP(Widget);
-  mrb_value arg;
-  mrb_get_args(mrb, "o", &arg);
-  mrb_value arg_value_context;
-  mrb_fltk3_Widget_context* arg_context = NULL;
-  arg_value_context = mrb_iv_get(mrb, arg, mrb_intern_lit(mrb, "context"));
-  Data_Get_Struct(mrb, arg_value_context, &fltk3_Widget_type, arg_context);
-  ((fltk3::Group*) context->v)->resizable(arg_context->v);
+  mrb_value b = mrb_nil_value();
+  mrb_value debounce = mrb_fixnum_value(0), throttle = mrb_fixnum_value(0);
+  mrb_get_args(mrb, "&|ii", &b, &debounce, &throttle);
+  mrb_fltk3_input* input = input_arg(mrb, context->v);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "on_change"), b);
+  fltk3::remove_timeout(mrb_fltk3_input::deliver, input);
+  if (mrb_nil_p(b)) {
+    if (input->notify) mrb_fltk3_unroot(input->notify);
+    input->notify = NULL;
+    return mrb_nil_value();
+  }
+  if (!input->notify) mrb_fltk3_root(context);
+  input->notify = context;
+  input->debounce = mrb_fixnum(debounce) / 1000.0;
+  input->throttle = mrb_fixnum(throttle) / 1000.0;
+  input->when(fltk3::WHEN_CHANGED);
+  input->callback(mrb_fltk3_input::changed, input);
   return mrb_nil_value();
 }
 
 /*********************************************************
- * FLTK3::*
+ * FLTK3::MenuBar
  *********************************************************/
+/* Menus built from a spec live in one contiguous MenuItem table owned by the
+ * bar. Every item callback goes through one trampoline; user_data is the
+ * index into the "menu_callbacks" ivar. */
+class mrb_fltk3_menubar : public fltk3::MenuBar {
+public:
+  fltk3::MenuItem* table;
+  std::vector<const char*> labels;
+  mrb_fltk3_Widget_context* context;
+
+  mrb_fltk3_menubar(int x, int y, int w, int h, const char* l = 0)
+    : fltk3::MenuBar(x, y, w, h, l), table(NULL), context(NULL) {}
+  virtual ~mrb_fltk3_menubar() {
+    menu(NULL);
+    release();
+    if (context) mrb_fltk3_unroot(context);
+  }
+
+  void release() {
+    for (size_t n = 0; n < labels.size(); n++)
+      mrb_fltk3_str_release(labels[n]);
+    labels.clear();
+    delete[] table;
+    table = NULL;
+  }
+
+  static void trampoline(fltk3::Widget* w, void* data) {
+    mrb_fltk3_menubar* bar = dynamic_cast<mrb_fltk3_menubar*>(w);
+    if (!bar || !bar->context) return;
+    mrb_fltk3_Widget_context* context = bar->context;
+    mrb_state* mrb = context->mrb;
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value procs = mrb_iv_get(mrb, context->instance, mrb_intern_lit(mrb, "menu_callbacks"));
+    mrb_value proc = mrb_ary_ref(mrb, procs, (mrb_int) (intptr_t) data);
+    if (!mrb_nil_p(proc)) {
+      const fltk3::MenuItem* item = bar->mvalue();
+      mrb_value args[2];
+      args[0] = context->instance;
+      args[1] = item && item->label() ? mrb_str_new_cstr(mrb, item->label()) : mrb_nil_value();
+      callback_count++;
+      mrb_yield_argv(mrb, proc, 2, args);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+};
+
 static mrb_value
-mrb_fltk3_run(mrb_state *mrb, mrb_value self)
+menu_spec_item(mrb_state *mrb, mrb_value spec, int n)
 {
-  return mrb_fixnum_value(fltk3::run());
+  return mrb_type(spec) == MRB_TT_ARRAY && n < RARRAY_LEN(spec) ?
+    mrb_ary_ref(mrb, spec, n) : mrb_nil_value();
 }
 
-static mrb_value
-mrb_fltk3_alert(mrb_state *mrb, mrb_value self)
+// Checks the whole spec before anything is allocated, so a bad entry can
+// raise without leaking a half built table.
+static int
+menu_spec_count(mrb_state *mrb, mrb_value spec)
 {
-  mrb_value s;
-  mrb_get_args(mrb, "S", &s);
-  fltk3::alert(RSTRING_PTR(s));
-  return mrb_nil_value();
+  if (mrb_type(spec) != MRB_TT_ARRAY) mrb_raise(mrb, E_ARGUMENT_ERROR, "menu spec must be an Array");
+  int count = 0;
+  for (int n = 0; n < RARRAY_LEN(spec); n++) {
+    mrb_value item = mrb_ary_ref(mrb, spec, n);
+    count++;
+    if (mrb_type(item) == MRB_TT_STRING) continue;
+    if (mrb_type(item) != MRB_TT_ARRAY || mrb_type(menu_spec_item(mrb, item, 0)) != MRB_TT_STRING)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "menu item must be a String or [label, shortcut, flags, proc, submenu]");
+    for (int i = 1; i <= 2; i++) {
+      mrb_value v = menu_spec_item(mrb, item, i);
+      if (!mrb_nil_p(v) && mrb_type(v) != MRB_TT_FIXNUM)
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "menu shortcut and flags must be Integers");
+    }
+    mrb_value proc = menu_spec_item(mrb, item, 3);
+    if (!mrb_nil_p(proc) && mrb_type(proc) != MRB_TT_PROC)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "menu callback must be a Proc");
+    mrb_value submenu = menu_spec_item(mrb, item, 4);
+    if (!mrb_nil_p(submenu)) count += menu_spec_count(mrb, submenu) + 1;
+  }
+  return count;
 }
 
-static mrb_value
-mrb_fltk3_choice(mrb_state *mrb, mrb_value self)
+static void
+menu_spec_fill(mrb_state *mrb, mrb_fltk3_menubar* bar, mrb_value spec, int* pos, mrb_value procs)
 {
-  mrb_value args[4];
-  mrb_get_args(mrb, "SSSS", &args[0], &args[1], &args[2], &args[3]);
-  return fltk3::choice("%s",
-    RSTRING_PTR(args[0]),
-    RSTRING_PTR(args[1]),
-    RSTRING_PTR(args[2]),
-    RSTRING_PTR(args[3])) ? mrb_true_value() : mrb_false_value();
+  for (int n = 0; n < RARRAY_LEN(spec); n++) {
+    mrb_value item = mrb_ary_ref(mrb, spec, n);
+    mrb_value label = mrb_type(item) == MRB_TT_STRING ? item : menu_spec_item(mrb, item, 0);
+    mrb_value shortcut = menu_spec_item(mrb, item, 1);
+    mrb_value flags = menu_spec_item(mrb, item, 2);
+    mrb_value proc = menu_spec_item(mrb, item, 3);
+    mrb_value submenu = menu_spec_item(mrb, item, 4);
+    fltk3::MenuItem& m = bar->table[(*pos)++];
+    m.text = mrb_fltk3_str_intern(RSTRING_PTR(label), RSTRING_LEN(label));
+    bar->labels.push_back(m.text);
+    if (!mrb_nil_p(shortcut)) m.shortcut_ = mrb_fixnum(shortcut);
+    if (!mrb_nil_p(flags)) m.flags = mrb_fixnum(flags);
+    if (!mrb_nil_p(proc)) {
+      m.callback_ = mrb_fltk3_menubar::trampoline;
+      m.user_data_ = (void*) (intptr_t) RARRAY_LEN(procs);
+      mrb_ary_push(mrb, procs, proc);
+    }
+    if (!mrb_nil_p(submenu)) {
+      m.flags |= fltk3::SUBMENU;
+      menu_spec_fill(mrb, bar, submenu, pos, procs);
+      (*pos)++;
+    }
+  }
+}
+
+static mrb_fltk3_menubar*
+menubar_arg(mrb_state *mrb, fltk3::Widget* w)
+{
+  mrb_fltk3_menubar* bar = dynamic_cast<mrb_fltk3_menubar*>(w);
+  if (!bar) mrb_raise(mrb, E_ARGUMENT_ERROR, "not a menu bar created from mruby");
+  return bar;
 }
 
 static mrb_value
-mrb_fltk3_ask(mrb_state *mrb, mrb_value self)
+mrb_fltk3_menubar_menu_set(mrb_state *mrb, mrb_value self)
 {
-  mrb_value arg;
-  mrb_get_args(mrb, "S", &arg);
-  return fltk3::ask("%s", RSTRING_PTR(arg)) ? mrb_true_value() : mrb_false_value();
+  CONTEXT_SETUP(Widget);
+  mrb_value spec;
+  mrb_get_args(mrb, "A", &spec);
+  mrb_fltk3_menubar* bar = menubar_arg(mrb, context->v);
+  int count = menu_spec_count(mrb, spec) + 1;
+  mrb_value procs = mrb_ary_new(mrb);
+  bar->menu(NULL);
+  bar->release();
+  bar->table = new fltk3::MenuItem[count]();
+  int pos = 0;
+  menu_spec_fill(mrb, bar, spec, &pos, procs);
+  if (!bar->context) mrb_fltk3_root(context);
+  bar->context = context;
+  bar->menu(bar->table);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "menu_callbacks"), procs);
+  bar->redraw();
+  return mrb_nil_value();
 }
 
 static mrb_value
-mrb_fltk3_set_fonts(mrb_state *mrb, mrb_value self)
+mrb_fltk3_menubar_add(mrb_state *mrb, mrb_value self)
 {
-  mrb_value s;
-  mrb_get_args(mrb, "S", &s);
-  return mrb_fixnum_value(fltk3::set_fonts(RSTRING_PTR(s)));
+  CONTEXT_SETUP(Widget);
+  mrb_value b = mrb_nil_value(), caption, shortcut = mrb_fixnum_value(0), flags = mrb_fixnum_value(0);
+  mrb_get_args(mrb, "&S|ii", &b, &caption, &shortcut, &flags);
+  mrb_fltk3_menubar* bar = menubar_arg(mrb, context->v);
+  mrb_value procs = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "menu_callbacks"));
+  if (mrb_nil_p(procs)) {
+    procs = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "menu_callbacks"), procs);
+  }
+  if (!bar->context) mrb_fltk3_root(context);
+  bar->context = context;
+  intptr_t slot = RARRAY_LEN(procs);
+  mrb_ary_push(mrb, procs, b);
+  int index = bar->add(RSTRING_PTR(caption), mrb_fixnum(shortcut),
+    mrb_nil_p(b) ? NULL : mrb_fltk3_menubar::trampoline, (void*) slot, mrb_fixnum(flags));
+  return mrb_fixnum_value(index);
 }
 
+// The wrapper is reused until the menu pointer changes. It refers to items
+// owned by the bar, so it is built without MenuItem#initialize.
 static mrb_value
-mrb_fltk3_font_name(mrb_state *mrb, mrb_value self)
+mrb_fltk3_menubar_menu_get(mrb_state *mrb, mrb_value self)
 {
-  mrb_value i;
-  mrb_get_args(mrb, "i", &i);
-  int font_type = 0;
-  const char *name = fltk3::get_font_name((fltk3::Font) mrb_fixnum(i), &font_type);
-  return name ? mrb_str_new_cstr(mrb, name) : mrb_nil_value();
+  CONTEXT_SETUP(Widget);
+  const fltk3::MenuItem* menu = ((fltk3::MenuBar*) context->v)->menu();
+  if (!menu) return mrb_nil_value();
+  mrb_value ptr = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "menu_ptr"));
+  if (mrb_type(ptr) == MRB_TT_CPTR && mrb_cptr(ptr) == (void*) menu)
+    return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "menu"));
+  struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
+  struct RClass* _class_fltk3_MenuItem = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "MenuItem")));
+  mrb_fltk3_MenuItem_context* item_context =
+    (mrb_fltk3_MenuItem_context*) malloc(sizeof(mrb_fltk3_MenuItem_context));
+  if (!item_context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
+  memset(item_context, 0, sizeof(mrb_fltk3_MenuItem_context));
+  item_context->v = (fltk3::MenuItem*) menu;
+  item_context->mrb = mrb;
+  mrb_value item = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_OBJECT, _class_fltk3_MenuItem));
+  item_context->instance = item;
+  mrb_iv_set(mrb, item, mrb_intern_lit(mrb, "context"), mrb_obj_value(
+    Data_Wrap_Struct(mrb, mrb->object_class,
+    &fltk3_MenuItem_type, (void*) item_context)));
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "menu_ptr"), mrb_cptr_value(mrb, (void*) menu));
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "menu"), item);
+  return item;
 }
 
-#define DECLARE_WIDGET(x)                                                 \
-static mrb_value                                                          \
+/*********************************************************
+ * FLTK3::Cell
+ *********************************************************/
+enum {
+  MRB_FLTK3_CELL_NUMBER,
+  MRB_FLTK3_CELL_STRING
+};
+
+/* Numbers are stored lock free; strings are guarded by the mutex. version is
+ * bumped after every store that changes the value, so readers only compare it
+ * to see a change. */
+struct mrb_fltk3_cell {
+  std::atomic<int> refs;
+  std::atomic<unsigned> version;
+  std::atomic<int> kind;
+  std::atomic<double> number;
+  std::mutex lock;
+  std::string text;
+  mrb_fltk3_cell() : refs(1), version(0), kind(MRB_FLTK3_CELL_NUMBER), number(0) {}
+};
+
+extern "C" void
+mrb_fltk3_cell_retain(mrb_fltk3_cell* cell)
+{
+  cell->refs++;
+}
+
+extern "C" void
+mrb_fltk3_cell_release(mrb_fltk3_cell* cell)
+{
+  if (cell && --cell->refs == 0) delete cell;
+}
+
+extern "C" void
+mrb_fltk3_cell_set_number(mrb_fltk3_cell* cell, double v)
+{
+  if (cell->kind.load() == MRB_FLTK3_CELL_NUMBER && cell->number.load() == v) return;
+  cell->number.store(v);
+  cell->kind.store(MRB_FLTK3_CELL_NUMBER);
+  cell->version++;
+}
+
+extern "C" void
+mrb_fltk3_cell_set_string(mrb_fltk3_cell* cell, const char* s, size_t len)
+{
+  {
+    std::lock_guard<std::mutex> guard(cell->lock);
+    if (cell->kind.load() == MRB_FLTK3_CELL_STRING &&
+      cell->text.size() == len && !memcmp(cell->text.data(), s, len)) return;
+    cell->text.assign(s, len);
+  }
+  cell->kind.store(MRB_FLTK3_CELL_STRING);
+  cell->version++;
+}
+
+static void
+fltk3_cell_free(mrb_state *mrb, void *p) {
+  mrb_fltk3_cell_release((mrb_fltk3_cell*) p);
+}
+static const struct mrb_data_type
+fltk3_cell_type = {
+  "fltk3_cell", fltk3_cell_free,
+};
+
+static mrb_fltk3_cell*
+cell_arg(mrb_state *mrb, mrb_value self)
+{
+  mrb_fltk3_cell* cell = NULL;
+  mrb_value value_context = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "context"));
+  Data_Get_Struct(mrb, value_context, &fltk3_cell_type, cell);
+  return cell;
+}
+
+extern "C" mrb_fltk3_cell*
+mrb_fltk3_cell_get(mrb_state* mrb, mrb_value cell)
+{
+  mrb_fltk3_cell* c = cell_arg(mrb, cell);
+  mrb_fltk3_cell_retain(c);
+  return c;
+}
+
+static void
+cell_store(mrb_state *mrb, mrb_fltk3_cell* cell, mrb_value v)
+{
+  switch (mrb_type(v)) {
+  case MRB_TT_FIXNUM:
+    mrb_fltk3_cell_set_number(cell, (double) mrb_fixnum(v));
+    break;
+  case MRB_TT_FLOAT:
+    mrb_fltk3_cell_set_number(cell, mrb_float(v));
+    break;
+  case MRB_TT_STRING:
+    mrb_fltk3_cell_set_string(cell, RSTRING_PTR(v), RSTRING_LEN(v));
+    break;
+  default:
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "cell value must be a Numeric or a String");
+  }
+}
+
+static mrb_value
+mrb_fltk3_cell_init(mrb_state *mrb, mrb_value self)
+{
+  mrb_value v = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &v);
+  mrb_fltk3_cell* cell = new mrb_fltk3_cell;
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(
+    Data_Wrap_Struct(mrb, mrb->object_class,
+    &fltk3_cell_type, (void*) cell)));
+  if (!mrb_nil_p(v)) cell_store(mrb, cell, v);
+  return self;
+}
+
+static mrb_value
+mrb_fltk3_cell_value_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_fltk3_cell* cell = cell_arg(mrb, self);
+  if (cell->kind.load() == MRB_FLTK3_CELL_NUMBER)
+    return mrb_float_value(mrb, cell->number.load());
+  std::lock_guard<std::mutex> guard(cell->lock);
+  return mrb_str_new(mrb, cell->text.data(), cell->text.size());
+}
+
+static mrb_value
+mrb_fltk3_cell_value_set(mrb_state *mrb, mrb_value self)
+{
+  mrb_value v;
+  mrb_get_args(mrb, "o", &v);
+  cell_store(mrb, cell_arg(mrb, self), v);
+  return v;
+}
+
+/* Bound widgets are polled from one fltk3 timeout instead of being redrawn on
+ * every store, so the redraw rate is capped at cell_refresh per second. */
+typedef struct {
+  fltk3::Widget* w;
+  mrb_fltk3_cell* cell;
+  unsigned seen;
+  std::string format;
+  char conv;
+} mrb_fltk3_cell_binding;
+
+static std::vector<mrb_fltk3_cell_binding>&
+cell_bindings()
+{
+  static std::vector<mrb_fltk3_cell_binding>* bindings = new std::vector<mrb_fltk3_cell_binding>;
+  return *bindings;
+}
+
+// Position of each bound widget in cell_bindings().
+static std::unordered_map<fltk3::Widget*, size_t>&
+cell_binding_index()
+{
+  static std::unordered_map<fltk3::Widget*, size_t>* index = new std::unordered_map<fltk3::Widget*, size_t>;
+  return *index;
+}
+
+static double cell_refresh = 60;
+static bool cell_ticking = false;
+
+static void
+mrb_fltk3_cell_unbind(fltk3::Widget* w)
+{
+  std::vector<mrb_fltk3_cell_binding>& bindings = cell_bindings();
+  std::unordered_map<fltk3::Widget*, size_t>& index = cell_binding_index();
+  std::unordered_map<fltk3::Widget*, size_t>::iterator it = index.find(w);
+  if (it == index.end()) return;
+  size_t n = it->second;
+  index.erase(it);
+  mrb_fltk3_cell_release(bindings[n].cell);
+  // The last binding moves into the gap; the tick doesn't depend on order.
+  if (n + 1 < bindings.size()) {
+    bindings[n] = bindings.back();
+    index[bindings[n].w] = n;
+  }
+  bindings.pop_back();
+}
+
+static void
+cell_binding_update(mrb_fltk3_cell_binding& b)
+{
+  double number = 0;
+  std::string text;
+  bool is_number = b.cell->kind.load() == MRB_FLTK3_CELL_NUMBER;
+  if (is_number) {
+    number = b.cell->number.load();
+  } else {
+    std::lock_guard<std::mutex> guard(b.cell->lock);
+    text = b.cell->text;
+  }
+  fltk3::ValueOutput* output = dynamic_cast<fltk3::ValueOutput*>(b.w);
+  if (output) {
+    output->value(is_number ? number : strtod(text.c_str(), NULL));
+    return;
+  }
+  char buf[256];
+  if (b.conv == 's') {
+    if (is_number) {
+      snprintf(buf, sizeof(buf), "%g", number);
+      text = buf;
+    }
+    snprintf(buf, sizeof(buf), b.format.c_str(), text.c_str());
+  } else {
+    snprintf(buf, sizeof(buf), b.format.c_str(), is_number ? number : strtod(text.c_str(), NULL));
+  }
+  const char* p = mrb_fltk3_str_intern(buf, strlen(buf));
+  mrb_fltk3_refs* refs = dynamic_cast<mrb_fltk3_refs*>(b.w);
+  if (refs) refs->ref(MRB_FLTK3_STR_label, p);
+  b.w->label(p);
+  b.w->redraw();
+}
+
+static void
+mrb_fltk3_cell_tick(void*)
+{
+  std::vector<mrb_fltk3_cell_binding>& bindings = cell_bindings();
+  for (size_t n = 0; n < bindings.size(); n++) {
+    unsigned version = bindings[n].cell->version.load();
+    if (version == bindings[n].seen) continue;
+    bindings[n].seen = version;
+    cell_binding_update(bindings[n]);
+  }
+  cell_ticking = !bindings.empty();
+  if (cell_ticking) fltk3::repeat_timeout(1.0 / cell_refresh, mrb_fltk3_cell_tick);
+}
+
+// Accepts exactly one conversion, either %s or a floating point one, so a
+// user supplied format can't read arguments that were never passed.
+static char
+cell_format_conv(mrb_state *mrb, const std::string& format)
+{
+  char conv = 0;
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '%') continue;
+    if (++i < format.size() && format[i] == '%') continue;
+    while (i < format.size() && strchr("-+ #0123456789.", format[i])) i++;
+    if (conv || i == format.size() || !strchr("sfFeEgGaA", format[i]))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "format must have one %s or floating point conversion");
+    conv = format[i];
+  }
+  if (!conv) mrb_raise(mrb, E_ARGUMENT_ERROR, "format must have one %s or floating point conversion");
+  return conv;
+}
+
+static mrb_value
+mrb_fltk3_widget_bind(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_value cell, format = mrb_nil_value();
+  mrb_get_args(mrb, "o|S", &cell, &format);
+  // Only widgets created from mruby unbind themselves when destroyed.
+  if (!dynamic_cast<mrb_fltk3_refs*>(context->v))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "not a widget created from mruby");
+  mrb_fltk3_cell_binding b;
+  b.w = context->v;
+  b.cell = cell_arg(mrb, cell);
+  b.format = mrb_nil_p(format) ? "%g" : std::string(RSTRING_PTR(format), RSTRING_LEN(format));
+  b.conv = cell_format_conv(mrb, b.format);
+  b.seen = b.cell->version.load() - 1;
+  mrb_fltk3_cell_unbind(b.w);
+  mrb_fltk3_cell_retain(b.cell);
+  cell_binding_index()[b.w] = cell_bindings().size();
+  cell_bindings().push_back(b);
+  if (!cell_ticking) {
+    cell_ticking = true;
+    fltk3::add_timeout(0, mrb_fltk3_cell_tick);
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_widget_unbind(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_fltk3_cell_unbind(context->v);
+  return mrb_nil_value();
+}
+
+/*********************************************************
+ * FLTK3::Flex, FLTK3::Grid
+ *********************************************************/
+/* Groups that compute their children's geometry natively whenever they are
+ * resized, so a window resize runs no Ruby code. */
+class mrb_fltk3_layout : public fltk3::Group {
+public:
+  int gap, margin;
+  mrb_fltk3_layout(int x, int y, int w, int h, const char* l = 0)
+    : fltk3::Group(x, y, w, h, l), gap(0), margin(0) {}
+  virtual void resize(int x, int y, int w, int h) {
+    fltk3::Widget::resize(x, y, w, h);
+    layout();
+  }
+  virtual void layout() = 0;
+  // Drops the settings of widgets that are no longer children, once there
+  // are more settings than children that have them.
+  template <class M> void prune(M& settings, size_t used) {
+    if (used == settings.size()) return;
+    std::unordered_set<fltk3::Widget*> kids;
+    for (int i = 0; i < children(); i++) kids.insert(child(i));
+    for (typename M::iterator it = settings.begin(); it != settings.end();) {
+      if (kids.count(it->first)) ++it;
+      else it = settings.erase(it);
+    }
+  }
+};
+
+/* Splits size between tracks by weight, honouring each track's min and max
+ * (0 for no max); tracks clamped to a bound are fixed and the rest
+ * redistributed. */
+static void
+layout_tracks(int size, const std::vector<int>& weight, const std::vector<int>& min, const std::vector<int>& max, std::vector<int>& out)
+{
+  int n = weight.size(), i;
+  std::vector<bool> fixed(n, false);
+  out.assign(n, 0);
+  for (i = 0; i < n; i++) {
+    if (weight[i] <= 0) {
+      out[i] = min[i];
+      fixed[i] = true;
+      size -= min[i];
+    }
+  }
+  if (size < 0) size = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int total = 0;
+    for (i = 0; i < n; i++) if (!fixed[i]) total += weight[i];
+    if (!total) break;
+    for (i = 0; i < n; i++) {
+      if (fixed[i]) continue;
+      int s = size * weight[i] / total;
+      if (s < min[i] || (max[i] > 0 && s > max[i])) {
+        out[i] = s < min[i] ? min[i] : max[i];
+        fixed[i] = true;
+        size -= out[i];
+        changed = true;
+        break;
+      }
+    }
+  }
+  int total = 0, last = -1;
+  for (i = 0; i < n; i++) if (!fixed[i]) total += weight[i];
+  int left = size;
+  for (i = 0; i < n; i++) {
+    if (fixed[i]) continue;
+    out[i] = size > 0 ? size * weight[i] / total : 0;
+    left -= out[i];
+    last = i;
+  }
+  if (last >= 0 && left > 0) out[last] += left;
+}
+
+class mrb_fltk3_flex : public mrb_fltk3_layout {
+public:
+  struct item { int weight, min, max; };
+  bool column;
+  std::unordered_map<fltk3::Widget*, item> items;
+  mrb_fltk3_flex(int x, int y, int w, int h, const char* l = 0)
+    : mrb_fltk3_layout(x, y, w, h, l), column(false) {}
+  virtual void layout() {
+    std::vector<fltk3::Widget*> kids;
+    std::vector<int> weight, min, max, sizes;
+    size_t used = 0;
+    for (int i = 0; i < children(); i++) {
+      fltk3::Widget* c = child(i);
+      std::unordered_map<fltk3::Widget*, item>::iterator it = items.find(c);
+      if (it != items.end()) used++;
+      if (!c->visible()) continue;
+      kids.push_back(c);
+      weight.push_back(it == items.end() ? 1 : it->second.weight);
+      min.push_back(it == items.end() ? 0 : it->second.min);
+      max.push_back(it == items.end() ? 0 : it->second.max);
+    }
+    prune(items, used);
+    int n = kids.size();
+    if (!n) return;
+    int main = (column ? h() : w()) - 2 * margin - gap * (n - 1);
+    int cross = (column ? w() : h()) - 2 * margin;
+    layout_tracks(main, weight, min, max, sizes);
+    int pos = (column ? y() : x()) + margin;
+    for (int i = 0; i < n; i++) {
+      if (column)
+        kids[i]->resize(x() + margin, pos, cross, sizes[i]);
+      else
+        kids[i]->resize(pos, y() + margin, sizes[i], cross);
+      pos += sizes[i] + gap;
+    }
+    redraw();
+  }
+};
+
+class mrb_fltk3_grid : public mrb_fltk3_layout {
+public:
+  struct cell { int row, col, rowspan, colspan; };
+  int rows, cols;
+  std::vector<int> row_weights, col_weights;
+  std::unordered_map<fltk3::Widget*, cell> cells;
+  mrb_fltk3_grid(int x, int y, int w, int h, const char* l = 0)
+    : mrb_fltk3_layout(x, y, w, h, l), rows(1), cols(1) {}
+  static void tracks(int size, int n, int gap, const std::vector<int>& weights, std::vector<int>& pos, std::vector<int>& len) {
+    std::vector<int> weight(n, 1), bound(n, 0);
+    for (int i = 0; i < n && i < (int) weights.size(); i++) weight[i] = weights[i];
+    layout_tracks(size - gap * (n - 1), weight, bound, bound, len);
+    pos.resize(n);
+    for (int i = 0, p = 0; i < n; i++) {
+      pos[i] = p;
+      p += len[i] + gap;
+    }
+  }
+  virtual void layout() {
+    if (rows < 1 || cols < 1) return;
+    std::vector<int> rpos, rlen, cpos, clen;
+    tracks(h() - 2 * margin, rows, gap, row_weights, rpos, rlen);
+    tracks(w() - 2 * margin, cols, gap, col_weights, cpos, clen);
+    size_t used = 0;
+    for (int i = 0; i < children(); i++) {
+      fltk3::Widget* c = child(i);
+      std::unordered_map<fltk3::Widget*, cell>::iterator it = cells.find(c);
+      if (it == cells.end()) continue;
+      used++;
+      cell& g = it->second;
+      if (g.row < 0 || g.col < 0 || g.row >= rows || g.col >= cols) continue;
+      int r1 = std::min(rows, g.row + std::max(1, g.rowspan)) - 1;
+      int c1 = std::min(cols, g.col + std::max(1, g.colspan)) - 1;
+      c->resize(x() + margin + cpos[g.col], y() + margin + rpos[g.row],
+        cpos[c1] + clen[c1] - cpos[g.col], rpos[r1] + rlen[r1] - rpos[g.row]);
+    }
+    prune(cells, used);
+    redraw();
+  }
+};
+
+static fltk3::Widget*
+widget_arg(mrb_state *mrb, mrb_value arg)
+{
+  mrb_value arg_value_context;
+  mrb_fltk3_Widget_context* arg_context = NULL;
+  arg_value_context = mrb_iv_get(mrb, arg, mrb_intern_lit(mrb, "context"));
+  Data_Get_Struct(mrb, arg_value_context, &fltk3_Widget_type, arg_context);
+  return arg_context->v;
+}
+
+/* The receiver as a T; raises TypeError when a layout method is called on
+ * some other widget. */
+template <class T> static T*
+layout_self(mrb_state *mrb, fltk3::Widget* w)
+{
+  T* layout = dynamic_cast<T*>(w);
+  if (!layout) mrb_raise(mrb, E_TYPE_ERROR, "not a layout of this kind");
+  return layout;
+}
+
+static fltk3::Widget*
+child_arg(mrb_state *mrb, fltk3::Group* group, mrb_value arg)
+{
+  fltk3::Widget* w = widget_arg(mrb, arg);
+  if (group->find(w) >= group->children())
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "widget is not a child of this layout");
+  return w;
+}
+
+static mrb_value
+mrb_fltk3_flex_direction_set(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_sym direction;
+  mrb_get_args(mrb, "n", &direction);
+  const char* name = mrb_sym2name(mrb, direction);
+  if (strcmp(name, "row") && strcmp(name, "column"))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "direction must be :row or :column");
+  mrb_fltk3_flex* flex = layout_self<mrb_fltk3_flex>(mrb, context->v);
+  flex->column = !strcmp(name, "column");
+  flex->layout();
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_flex_set(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_value widget, weight, min = mrb_fixnum_value(0), max = mrb_fixnum_value(0);
+  mrb_get_args(mrb, "oi|ii", &widget, &weight, &min, &max);
+  mrb_fltk3_flex* flex = layout_self<mrb_fltk3_flex>(mrb, context->v);
+  mrb_fltk3_flex::item item = { (int) mrb_fixnum(weight), (int) mrb_fixnum(min), (int) mrb_fixnum(max) };
+  flex->items[child_arg(mrb, flex, widget)] = item;
+  flex->layout();
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_grid_place(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_value widget, row, col, rowspan = mrb_fixnum_value(1), colspan = mrb_fixnum_value(1);
+  mrb_get_args(mrb, "oii|ii", &widget, &row, &col, &rowspan, &colspan);
+  mrb_fltk3_grid* grid = layout_self<mrb_fltk3_grid>(mrb, context->v);
+  mrb_fltk3_grid::cell cell = {
+    (int) mrb_fixnum(row), (int) mrb_fixnum(col),
+    (int) mrb_fixnum(rowspan), (int) mrb_fixnum(colspan)
+  };
+  grid->cells[child_arg(mrb, grid, widget)] = cell;
+  grid->layout();
+  return mrb_nil_value();
+}
+
+static void
+weights_arg(mrb_state *mrb, mrb_value arr, std::vector<int>& weights)
+{
+  int n, len = RARRAY_LEN(arr);
+  weights.resize(len);
+  for (n = 0; n < len; n++)
+    weights[n] = mrb_fixnum(mrb_funcall(mrb, RARRAY_PTR(arr)[n], "to_i", 0, NULL));
+}
+
+/*********************************************************
+ * FLTK3::Group
+ *********************************************************/
+static mrb_value
+mrb_fltk3_group_begin(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_value b = mrb_nil_value();
+  mrb_get_args(mrb, "&", &b);
+  if (!mrb_nil_p(b)) {
+    mrb_value args[1];
+    args[0] = self;
+    ((fltk3::Group*)context->v)->begin();
+    mrb_yield_argv(mrb, b, 1, args);
+    ((fltk3::Group*)context->v)->end();
+    mrb_fltk3_layout* layout = dynamic_cast<mrb_fltk3_layout*>(context->v);
+    if (layout) layout->layout();
+  } else
+    ((fltk3::Group*)context->v)->begin();
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_group_end(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  ((fltk3::Group*)context->v)->end();
+  mrb_fltk3_layout* layout = dynamic_cast<mrb_fltk3_layout*>(context->v);
+  if (layout) layout->layout();
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_group_resizable_get(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
+  struct RClass* _class_fltk3_Widget = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Widget")));
+  mrb_value args[1];
+  args[0] = mrb_obj_value(
+    Data_Wrap_Struct(mrb, mrb->object_class,
+    &fltk3_Widget_type, (void*) ((fltk3::Group*) context->v)->resizable()));
+  return mrb_class_new_instance(mrb, 1, args, _class_fltk3_Widget);
+}
+
+static mrb_value
+mrb_fltk3_group_resizable_set(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_value arg;
+  mrb_get_args(mrb, "o", &arg);
+  mrb_value arg_value_context;
+  mrb_fltk3_Widget_context* arg_context = NULL;
+  arg_value_context = mrb_iv_get(mrb, arg, mrb_intern_lit(mrb, "context"));
+  Data_Get_Struct(mrb, arg_value_context, &fltk3_Widget_type, arg_context);
+  ((fltk3::Group*) context->v)->resizable(arg_context->v);
+  return mrb_nil_value();
+}
+
+/*********************************************************
+ * FLTK3::Browser
+ *********************************************************/
+typedef struct {
+  std::string query;
+  bool icase;
+  bool regex;
+} mrb_fltk3_browser_filter;
+
+static void
+fltk3_browser_filter_free(mrb_state *mrb, void *p) {
+  delete (mrb_fltk3_browser_filter*) p;
+}
+static const struct mrb_data_type
+fltk3_browser_filter_type = {
+  "fltk3_browser_filter", fltk3_browser_filter_free,
+};
+
+static void
+browser_lower(std::string& out, const char* s)
+{
+  size_t n = strlen(s);
+  out.resize(n);
+  for (size_t i = 0; i < n; i++)
+    out[i] = (char) tolower((unsigned char) s[i]);
+}
+
+static mrb_value
+mrb_fltk3_browser_filter_set(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  fltk3::Browser* browser = (fltk3::Browser*) context->v;
+  mrb_value pattern, icase = mrb_false_value();
+  mrb_get_args(mrb, "o|o", &pattern, &icase);
+
+  mrb_fltk3_browser_filter next;
+  next.icase = mrb_test(icase);
+  next.regex = mrb_type(pattern) != MRB_TT_STRING;
+  if (!next.regex) {
+    next.query = std::string(RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    if (next.icase) browser_lower(next.query, next.query.c_str());
+  }
+
+#ifdef MRB_FLTK3_USE_REGEX
+  regex_t re;
+  if (next.regex) mrb_fltk3_regex_compile(mrb, &re, pattern, next.icase);
+#else
+  if (next.regex)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "regular expressions are not supported");
+#endif
+
+  // A query that contains the previous one can only match a subset of the
+  // lines, so lines hidden by the previous query are left alone.
+  mrb_value value_filter = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "filter"));
+  mrb_fltk3_browser_filter* prev = NULL;
+  if (!mrb_nil_p(value_filter))
+    Data_Get_Struct(mrb, value_filter, &fltk3_browser_filter_type, prev);
+  bool narrow = prev && !prev->regex && !next.regex &&
+    prev->icase == next.icase &&
+    next.query.find(prev->query) != std::string::npos;
+
+  std::string lower;
+  int n, size = browser->size(), shown = 0;
+  for (n = 1; n <= size; n++) {
+    if (narrow && !browser->visible(n)) continue;
+    const char* text = browser->text(n);
+    if (!text) text = "";
+    bool match = false;
+    if (next.regex) {
+#ifdef MRB_FLTK3_USE_REGEX
+      match = regexec(&re, text, 0, NULL, 0) == 0;
+#endif
+    } else if (next.query.empty()) {
+      match = true;
+    } else if (next.icase) {
+      browser_lower(lower, text);
+      match = strstr(lower.c_str(), next.query.c_str()) != NULL;
+    } else {
+      match = strstr(text, next.query.c_str()) != NULL;
+    }
+    if (match) {
+      if (!browser->visible(n)) browser->show(n);
+      shown++;
+    } else if (browser->visible(n)) {
+      browser->hide(n);
+    }
+  }
+#ifdef MRB_FLTK3_USE_REGEX
+  if (next.regex) regfree(&re);
+#endif
+
+  if (prev) {
+    *prev = next;
+  } else {
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "filter"), mrb_obj_value(
+      Data_Wrap_Struct(mrb, mrb->object_class,
+      &fltk3_browser_filter_type, (void*) new mrb_fltk3_browser_filter(next))));
+  }
+  return mrb_fixnum_value(shown);
+}
+
+static mrb_value
+mrb_fltk3_browser_filter_clear(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  fltk3::Browser* browser = (fltk3::Browser*) context->v;
+  int n, size = browser->size();
+  for (n = 1; n <= size; n++) {
+    if (!browser->visible(n)) browser->show(n);
+  }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "filter"), mrb_nil_value());
+  return mrb_nil_value();
+}
+
+/*********************************************************
+ * Rendering
+ *********************************************************/
+static int render_usec = 0;
+
+/* Images made here belong to their FLTK3::Image object, whose "owner" deletes
+ * them when it is collected or released. */
+static void
+fltk3_owned_image_free(mrb_state *mrb, void *p) {
+  delete (fltk3::Image*) p;
+}
+static const struct mrb_data_type
+fltk3_owned_image_type = {
+  "fltk3_owned_image", fltk3_owned_image_free,
+};
+
+static mrb_value
+mrb_fltk3_image_wrap(mrb_state *mrb, fltk3::Image* image)
+{
+  mrb_fltk3_Image_context* image_context =
+    (mrb_fltk3_Image_context*) malloc(sizeof(mrb_fltk3_Image_context));
+  if (!image_context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
+  memset(image_context, 0, sizeof(mrb_fltk3_Image_context));
+  image_context->mrb = mrb;
+  image_context->v = image;
+  mrb_value args[1];
+  struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
+  struct RClass* _class_fltk3_Image = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Image")));
+  args[0] = mrb_obj_value(
+    Data_Wrap_Struct(mrb, mrb->object_class,
+    &fltk3_Image_type, (void*) image_context));
+  mrb_value instance = mrb_class_new_instance(mrb, 1, args, _class_fltk3_Image);
+  mrb_iv_set(mrb, instance, mrb_intern_lit(mrb, "owner"), mrb_obj_value(
+    Data_Wrap_Struct(mrb, mrb->object_class,
+    &fltk3_owned_image_type, (void*) image)));
+  return instance;
+}
+
+/* Box-filters the w x h x d pixels into sw x sh; upscaling picks the nearest
+ * source pixel. */
+static fltk3::uchar*
+resample(const fltk3::uchar* src, int w, int h, int d, int ld, int sw, int sh)
+{
+  fltk3::uchar* dst = new fltk3::uchar[sw * sh * d];
+  if (!ld) ld = w * d;
+  for (int dy = 0; dy < sh; dy++) {
+    int y0 = dy * h / sh, y1 = (dy + 1) * h / sh;
+    if (y1 <= y0) y1 = y0 + 1;
+    for (int dx = 0; dx < sw; dx++) {
+      int x0 = dx * w / sw, x1 = (dx + 1) * w / sw;
+      if (x1 <= x0) x1 = x0 + 1;
+      for (int c = 0; c < d; c++) {
+        int sum = 0;
+        for (int y = y0; y < y1; y++)
+          for (int x = x0; x < x1; x++)
+            sum += src[y * ld + x * d + c];
+        dst[(dy * sw + dx) * d + c] = sum / ((y1 - y0) * (x1 - x0));
+      }
+    }
+  }
+  return dst;
+}
+
+static mrb_value
+mrb_fltk3_widget_render_to_image(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  mrb_value scale_value = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &scale_value);
+  double scale = 1.0;
+  if (mrb_float_p(scale_value)) scale = mrb_float(scale_value);
+  else if (mrb_fixnum_p(scale_value)) scale = mrb_fixnum(scale_value);
+  if (scale <= 0) mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid scale");
+
+  fltk3::Widget* w = context->v;
+  int x = 0, y = 0;
+  if (!dynamic_cast<fltk3::Window*>(w)) {
+    x = w->x();
+    y = w->y();
+  }
+  if (w->w() < 1 || w->h() < 1) mrb_raise(mrb, E_ARGUMENT_ERROR, "widget has no size");
+
+  // The widget is drawn on its own into an offscreen buffer laid out like its
+  // window, so the window needn't be shown and nothing covering it on screen
+  // is read back. render_usec covers just the draw() call.
+  fltk3::open_display();
+  fltk3::Offscreen offscreen = fltk3::create_offscreen(x + w->w(), y + w->h());
+  if (!offscreen) mrb_raise(mrb, E_RUNTIME_ERROR, "can't create offscreen buffer");
+  fltk3::begin_offscreen(offscreen);
+  fltk3::uchar damage = w->damage();
+  w->clear_damage(fltk3::DAMAGE_ALL);
+  double start = mrb_fltk3_now();
+  w->draw();
+  render_usec = (int) ((mrb_fltk3_now() - start) * 1000000.0);
+  w->clear_damage(damage);
+  fltk3::uchar* pixels = fltk3::read_image(NULL, x, y, w->w(), w->h());
+  fltk3::end_offscreen();
+  fltk3::delete_offscreen(offscreen);
+  if (!pixels) mrb_raise(mrb, E_RUNTIME_ERROR, "can't read image");
+  int sw = (int) (w->w() * scale + 0.5), sh = (int) (w->h() * scale + 0.5);
+  if (sw < 1) sw = 1;
+  if (sh < 1) sh = 1;
+  if (sw != w->w() || sh != w->h()) {
+    fltk3::uchar* scaled = resample(pixels, w->w(), w->h(), 3, 0, sw, sh);
+    delete[] pixels;
+    pixels = scaled;
+  }
+  fltk3::RGBImage* image = new fltk3::RGBImage(pixels, sw, sh, 3);
+  image->alloc_array = 1;
+  return mrb_fltk3_image_wrap(mrb, image);
+}
+
+static const fltk3::uchar*
+image_pixels(mrb_state *mrb, fltk3::Image* image)
+{
+  if (image->count() != 1 || image->d() < 1 || !image->data())
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "not a pixel image");
+  return (const fltk3::uchar*) image->data()[0];
+}
+
+static mrb_value
+mrb_fltk3_image_data(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Image);
+  fltk3::Image* image = context->v;
+  const fltk3::uchar* src = image_pixels(mrb, image);
+  int w = image->w(), h = image->h(), d = image->d();
+  int ld = image->ld() ? image->ld() : w * d;
+  if (ld == w * d) return mrb_str_new(mrb, (const char*) src, w * h * d);
+  std::vector<char> packed(w * h * d);
+  for (int y = 0; y < h; y++)
+    memcpy(&packed[y * w * d], src + y * ld, w * d);
+  return mrb_str_new(mrb, packed.empty() ? "" : &packed[0], packed.size());
+}
+
+/* 64 bit difference hash of a 9x8 grayscale thumbnail, as 16 hex digits;
+ * visually similar images differ in few bits. */
+static mrb_value
+mrb_fltk3_image_phash(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Image);
+  fltk3::Image* image = context->v;
+  const fltk3::uchar* src = image_pixels(mrb, image);
+  int d = image->d();
+  fltk3::uchar* thumb = resample(src, image->w(), image->h(), d, image->ld(), 9, 8);
+  uint64_t hash = 0;
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++) {
+      int a = 0, b = 0;
+      for (int c = 0; c < d && c < 3; c++) {
+        a += thumb[(y * 9 + x) * d + c];
+        b += thumb[(y * 9 + x + 1) * d + c];
+      }
+      hash = (hash << 1) | (a > b ? 1 : 0);
+    }
+  }
+  delete[] thumb;
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%08x%08x", (unsigned) (hash >> 32), (unsigned) hash);
+  return mrb_str_new(mrb, hex, 16);
+}
+
+/* Mean absolute difference of all channels, from 0.0 (identical) to 1.0. */
+static mrb_value
+mrb_fltk3_image_diff(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Image);
+  mrb_value other;
+  mrb_get_args(mrb, "o", &other);
+  mrb_value other_value_context;
+  mrb_fltk3_Image_context* other_context = NULL;
+  other_value_context = mrb_iv_get(mrb, other, mrb_intern_lit(mrb, "context"));
+  Data_Get_Struct(mrb, other_value_context, &fltk3_Image_type, other_context);
+  fltk3::Image* a = context->v;
+  fltk3::Image* b = other_context->v;
+  if (a->w() != b->w() || a->h() != b->h() || a->d() != b->d())
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "image sizes differ");
+  const fltk3::uchar* pa = image_pixels(mrb, a);
+  const fltk3::uchar* pb = image_pixels(mrb, b);
+  int w = a->w(), h = a->h(), d = a->d();
+  int lda = a->ld() ? a->ld() : w * d, ldb = b->ld() ? b->ld() : w * d;
+  double sum = 0;
+  for (int y = 0; y < h; y++) {
+    int row = 0;
+    for (int i = 0; i < w * d; i++)
+      row += abs(pa[y * lda + i] - pb[y * ldb + i]);
+    sum += row;
+  }
+  double n = (double) w * h * d;
+  return mrb_float_value(mrb, n > 0 ? sum / (255.0 * n) : 0.0);
+}
+
+/*********************************************************
+ * FLTK3::*
+ *********************************************************/
+static void
+mrb_fltk3_run_end(mrb_state *mrb)
+{
+  fltk3::remove_timeout(mrb_fltk3_gc_tick);
+  if (gc_sched.input) mrb_fltk3_gc_restore(mrb);
+  gc_sched.mrb = NULL;
+}
+
+/* An exception raised by a callback unwinds straight out of fltk3::run(), so
+ * it is caught here to switch the collector back on before it is re-raised. */
+static mrb_value
+mrb_fltk3_run(mrb_state *mrb, mrb_value self)
+{
+  int r = 0;
+  event_synthetic = 0;
+  gc_sched.mrb = mrb;
+#ifdef MRB_TRY
+  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  MRB_TRY(&c_jmp) {
+    mrb->jmp = &c_jmp;
+    r = fltk3::run();
+    mrb->jmp = prev_jmp;
+  } MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+    mrb_fltk3_run_end(mrb);
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->exc));
+  } MRB_END_EXC(&c_jmp);
+#else
+  jmp_buf* prev_jmp = mrb->jmp;
+  jmp_buf c_jmp;
+  if (setjmp(c_jmp) == 0) {
+    mrb->jmp = &c_jmp;
+    r = fltk3::run();
+    mrb->jmp = prev_jmp;
+  } else {
+    mrb->jmp = prev_jmp;
+    mrb_fltk3_run_end(mrb);
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->exc));
+  }
+#endif
+  mrb_fltk3_run_end(mrb);
+  return mrb_fixnum_value(r);
+}
+
+/* FL_Button and FL_BUTTON1 from the fltk headers; fltk3 derives
+ * event_button() and the button state bits from them. */
+#define MRB_FLTK3_MOUSE_BUTTON 0xfee8
+#define MRB_FLTK3_BUTTON1 0x01000000
+
+static int
+mrb_fltk3_event_dispatch(int e, fltk3::Window* win, const char* text, int text_len)
+{
+  char* saved_text = fltk3::e_text;
+  int saved_length = fltk3::e_length;
+  fltk3::e_number = e;
+  fltk3::e_text = (char*) (text ? text : "");
+  fltk3::e_length = text_len;
+  event_synthetic++;
+  int r = fltk3::handle(e, win);
+  event_synthetic--;
+  fltk3::e_text = saved_text;
+  fltk3::e_length = saved_length;
+  return r;
+}
+
+static mrb_value
+mrb_fltk3_simulate(mrb_state *mrb, mrb_value self)
+{
+  mrb_value widget, *argv;
+  mrb_sym type;
+  int argc;
+  mrb_get_args(mrb, "on*", &widget, &type, &argv, &argc);
+  mrb_value value_context;
+  mrb_fltk3_Widget_context* context = NULL;
+  value_context = mrb_iv_get(mrb, widget, mrb_intern_lit(mrb, "context"));
+  Data_Get_Struct(mrb, value_context, &fltk3_Widget_type, context);
+  fltk3::Widget* w = context->v;
+  fltk3::Window* win = dynamic_cast<fltk3::Window*>(w);
+  int ox = 0, oy = 0;
+  if (!win) {
+    win = w->window();
+    ox = w->x();
+    oy = w->y();
+  }
+  if (!win) mrb_raise(mrb, E_ARGUMENT_ERROR, "widget is not in a window");
+
+  const char* name = mrb_sym2name(mrb, type);
+  if (!strcmp(name, "key")) {
+    if (argc != 1) mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid argument");
+    const char* text = NULL;
+    int len = 0;
+    if (mrb_type(argv[0]) == MRB_TT_STRING) {
+      text = RSTRING_PTR(argv[0]);
+      len = RSTRING_LEN(argv[0]);
+      fltk3::e_keysym = len ? (unsigned char) text[0] : 0;
+    } else if (mrb_fixnum_p(argv[0]) && mrb_fixnum(argv[0]) > 0 && mrb_fixnum(argv[0]) <= 0xffff) {
+      fltk3::e_keysym = mrb_fixnum(argv[0]);
+    } else {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "key must be a String or a keysym from 1 to 0xffff");
+    }
+    int r = mrb_fltk3_event_dispatch(fltk3::KEYDOWN, win, text, len);
+    mrb_fltk3_event_dispatch(fltk3::KEYUP, win, text, len);
+    return r ? mrb_true_value() : mrb_false_value();
+  }
+
+  int e;
+  if (!strcmp(name, "push")) e = fltk3::PUSH;
+  else if (!strcmp(name, "release")) e = fltk3::RELEASE;
+  else if (!strcmp(name, "drag")) e = fltk3::DRAG;
+  else if (!strcmp(name, "move")) e = fltk3::MOVE;
+  else mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown event type");
+  int x = w->w() / 2, y = w->h() / 2, button = 1;
+  if (argc > 0) x = mrb_fixnum(argv[0]);
+  if (argc > 1) y = mrb_fixnum(argv[1]);
+  if (argc > 2) button = mrb_fixnum(argv[2]);
+  if (button < 1 || button > 3) mrb_raise(mrb, E_ARGUMENT_ERROR, "button must be 1, 2 or 3");
+  fltk3::e_x = ox + x;
+  fltk3::e_y = oy + y;
+  fltk3::e_x_root = win->x() + fltk3::e_x;
+  fltk3::e_y_root = win->y() + fltk3::e_y;
+  fltk3::e_keysym = MRB_FLTK3_MOUSE_BUTTON + button;
+  if (e == fltk3::PUSH || e == fltk3::DRAG)
+    fltk3::e_state |= MRB_FLTK3_BUTTON1 << (button - 1);
+  else
+    fltk3::e_state &= ~(MRB_FLTK3_BUTTON1 << (button - 1));
+  fltk3::e_is_click = e == fltk3::RELEASE;
+  fltk3::e_clicks = 0;
+  return mrb_fltk3_event_dispatch(e, win, NULL, 0) ? mrb_true_value() : mrb_false_value();
+}
+
+static mrb_value
+mrb_fltk3_record(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path;
+  mrb_get_args(mrb, "S", &path);
+  if (event_recorder) fclose(event_recorder);
+  event_recorder = fopen(RSTRING_PTR(path), "wb");
+  if (!event_recorder) mrb_raise(mrb, E_RUNTIME_ERROR, "can't open file");
+  fwrite("FLR1", 1, 4, event_recorder);
+  event_recorder_last = mrb_fltk3_now();
+  event_recorder_count = 0;
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_record_stop(mrb_state *mrb, mrb_value self)
+{
+  if (!event_recorder) return mrb_nil_value();
+  fclose(event_recorder);
+  event_recorder = NULL;
+  return mrb_fixnum_value(event_recorder_count);
+}
+
+static int
+usec_compare(const void* a, const void* b)
+{
+  return *(const int*) a - *(const int*) b;
+}
+
+/* Plays a recorded session back through fltk3::handle, at the recorded pace
+ * or as fast as possible, and reports how long each event took to handle
+ * including the callbacks it triggered. */
+static mrb_value
+mrb_fltk3_replay(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path, max_speed = mrb_false_value();
+  mrb_get_args(mrb, "S|o", &path, &max_speed);
+  FILE* fp = fopen(RSTRING_PTR(path), "rb");
+  if (!fp) mrb_raise(mrb, E_RUNTIME_ERROR, "can't open file");
+  char magic[4];
+  if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "FLR1", 4)) {
+    fclose(fp);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "not an event recording");
+  }
+
+  std::vector<int> latencies;
+  std::vector<fltk3::Window*>& windows = event_windows();
+  int callbacks = callback_count;
+  double start = mrb_fltk3_now(), due = start;
+  mrb_fltk3_event_entry r;
+  char text[256];
+  while (fread(&r, sizeof(r), 1, fp) == 1) {
+    if (r.text_len && fread(text, 1, r.text_len, fp) != r.text_len) break;
+    text[r.text_len] = '\0';
+    if (r.window >= windows.size() || !windows[r.window]) continue;
+    fltk3::Window* win = windows[r.window];
+    if (!mrb_test(max_speed)) {
+      due += r.usec / 1000000.0;
+      double now;
+      while ((now = mrb_fltk3_now()) < due)
+        fltk3::wait(due - now);
+    } else if (latencies.size() % 64 == 0) {
+      fltk3::check();
+    }
+    fltk3::e_x = r.x;
+    fltk3::e_y = r.y;
+    fltk3::e_x_root = win->x() + r.x;
+    fltk3::e_y_root = win->y() + r.y;
+    fltk3::e_dx = r.dx;
+    fltk3::e_dy = r.dy;
+    fltk3::e_state = r.state;
+    fltk3::e_keysym = r.key;
+    fltk3::e_clicks = r.clicks;
+    fltk3::e_is_click = r.event == fltk3::RELEASE && !r.clicks;
+    double t = mrb_fltk3_now();
+    mrb_fltk3_event_dispatch(r.event, win, text, r.text_len);
+    latencies.push_back((int) ((mrb_fltk3_now() - t) * 1000000.0));
+  }
+  fclose(fp);
+  fltk3::flush();
+
+  int total = (int) ((mrb_fltk3_now() - start) * 1000000.0);
+  int n = latencies.size(), i;
+  int64_t sum = 0;
+  for (i = 0; i < n; i++) sum += latencies[i];
+  if (n) qsort(&latencies[0], n, sizeof(int), usec_compare);
+  callbacks = callback_count - callbacks;
+
+  mrb_value stats = mrb_hash_new(mrb);
+#define SET_STAT(k, v) \
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, k)), mrb_fixnum_value(v))
+  SET_STAT("events", n);
+  SET_STAT("callbacks", callbacks);
+  SET_STAT("total_usec", total);
+  SET_STAT("callbacks_per_sec", total ? (int) (callbacks * 1000000.0 / total) : 0);
+  SET_STAT("latency_avg_usec", n ? (int) (sum / n) : 0);
+  SET_STAT("latency_p50_usec", n ? latencies[n / 2] : 0);
+  SET_STAT("latency_p99_usec", n ? latencies[n * 99 / 100] : 0);
+  SET_STAT("latency_max_usec", n ? latencies[n - 1] : 0);
+#undef SET_STAT
+  return stats;
+}
+
+static mrb_value
+mrb_fltk3_gc_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_value stats = mrb_hash_new(mrb);
+  mrb_value histogram = mrb_ary_new(mrb);
+  int n;
+  for (n = 0; n < MRB_FLTK3_GC_BUCKETS; n++)
+    mrb_ary_push(mrb, histogram, mrb_fixnum_value(gc_sched.histogram[n]));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "slices")), mrb_fixnum_value(gc_sched.slices));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "deferred")), mrb_fixnum_value(gc_sched.deferred));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "histogram")), histogram);
+  histogram = mrb_ary_new(mrb);
+  for (n = 0; n < MRB_FLTK3_GC_BUCKETS; n++)
+    mrb_ary_push(mrb, histogram, mrb_fixnum_value(gc_sched.input_histogram[n]));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "input_pauses")), mrb_fixnum_value(gc_sched.input_pauses));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "input_max_usec")), mrb_fixnum_value(gc_sched.input_max_usec));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "input_histogram")), histogram);
+  return stats;
+}
+
+static mrb_value
+mrb_fltk3_alert(mrb_state *mrb, mrb_value self)
+{
+  mrb_value s;
+  mrb_get_args(mrb, "S", &s);
+  fltk3::alert(RSTRING_PTR(s));
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_fltk3_choice(mrb_state *mrb, mrb_value self)
+{
+  mrb_value args[4];
+  mrb_get_args(mrb, "SSSS", &args[0], &args[1], &args[2], &args[3]);
+  return fltk3::choice("%s",
+    RSTRING_PTR(args[0]),
+    RSTRING_PTR(args[1]),
+    RSTRING_PTR(args[2]),
+    RSTRING_PTR(args[3])) ? mrb_true_value() : mrb_false_value();
+}
+
+static mrb_value
+mrb_fltk3_ask(mrb_state *mrb, mrb_value self)
+{
+  mrb_value arg;
+  mrb_get_args(mrb, "S", &arg);
+  return fltk3::ask("%s", RSTRING_PTR(arg)) ? mrb_true_value() : mrb_false_value();
+}
+
+static int font_count = fltk3::FREE_FONT;
+
+static mrb_value
+mrb_fltk3_set_fonts(mrb_state *mrb, mrb_value self)
+{
+  mrb_value s;
+  mrb_get_args(mrb, "S", &s);
+  font_count = fltk3::set_fonts(RSTRING_PTR(s));
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "fonts"), mrb_nil_value());
+  return mrb_fixnum_value(font_count);
+}
+
+/* Descriptors are built once per set_fonts call and kept on the FLTK3 module. */
+static mrb_value
+mrb_fltk3_fonts(mrb_state *mrb, mrb_value self)
+{
+  mrb_value fonts = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "fonts"));
+  if (!mrb_nil_p(fonts)) return fonts;
+  fonts = mrb_ary_new_capa(mrb, font_count);
+  int ai = mrb_gc_arena_save(mrb);
+  for (int n = 0; n < font_count; n++) {
+    int font_type = 0;
+    const char *name = fltk3::get_font_name((fltk3::Font) n, &font_type);
+    mrb_value font = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, font, mrb_symbol_value(mrb_intern_lit(mrb, "index")), mrb_fixnum_value(n));
+    mrb_hash_set(mrb, font, mrb_symbol_value(mrb_intern_lit(mrb, "name")), name ? mrb_str_new_cstr(mrb, name) : mrb_nil_value());
+    mrb_hash_set(mrb, font, mrb_symbol_value(mrb_intern_lit(mrb, "bold")), (font_type & fltk3::BOLD) ? mrb_true_value() : mrb_false_value());
+    mrb_hash_set(mrb, font, mrb_symbol_value(mrb_intern_lit(mrb, "italic")), (font_type & fltk3::ITALIC) ? mrb_true_value() : mrb_false_value());
+    mrb_ary_push(mrb, fonts, font);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "fonts"), fonts);
+  return fonts;
+}
+
+/* Widths of ASCII glyphs per font and size, filled in as they are first
+ * seen. Lines with other bytes fall back to fltk3::width. */
+typedef struct {
+  double glyphs[128];
+  int height;
+} mrb_fltk3_font_metrics;
+
+static mrb_fltk3_font_metrics&
+font_metrics(fltk3::Font font, fltk3::Fontsize size)
+{
+  static std::unordered_map<long, mrb_fltk3_font_metrics>* cache =
+    new std::unordered_map<long, mrb_fltk3_font_metrics>;
+  long key = ((long) font << 16) | (size & 0xffff);
+  std::unordered_map<long, mrb_fltk3_font_metrics>::iterator it = cache->find(key);
+  if (it != cache->end()) return it->second;
+  mrb_fltk3_font_metrics& m = (*cache)[key];
+  for (int n = 0; n < 128; n++) m.glyphs[n] = -1;
+  m.height = fltk3::height();
+  return m;
+}
+
+static double
+line_width(mrb_fltk3_font_metrics& m, const char* p, int len)
+{
+  double w = 0;
+  for (int i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) p[i];
+    if (c >= 128) return fltk3::width(p, len);
+    if (m.glyphs[c] < 0) m.glyphs[c] = fltk3::width((unsigned int) c);
+    w += m.glyphs[c];
+  }
+  return w;
+}
+
+static mrb_value
+mrb_fltk3_measure(mrb_state *mrb, mrb_value self)
+{
+  mrb_value strings, font, size;
+  mrb_get_args(mrb, "Aii", &strings, &font, &size);
+  static bool display = false;
+  if (!display) {
+    fltk3::open_display();
+    display = true;
+  }
+  fltk3::Font old_font = fltk3::font();
+  fltk3::Fontsize old_size = fltk3::size();
+  fltk3::font((fltk3::Font) mrb_fixnum(font), (fltk3::Fontsize) mrb_fixnum(size));
+  mrb_fltk3_font_metrics& m = font_metrics((fltk3::Font) mrb_fixnum(font), (fltk3::Fontsize) mrb_fixnum(size));
+  int n = RARRAY_LEN(strings);
+  mrb_value result = mrb_ary_new_capa(mrb, n * 2);
+  for (int i = 0; i < n; i++) {
+    mrb_value s = mrb_ary_ref(mrb, strings, i);
+    if (mrb_type(s) != MRB_TT_STRING) {
+      fltk3::font(old_font, old_size);
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "measure takes an Array of Strings");
+    }
+    const char* p = RSTRING_PTR(s);
+    const char* end = p + RSTRING_LEN(s);
+    double w = 0;
+    int lines = 0;
+    while (true) {
+      const char* nl = (const char*) memchr(p, '\n', end - p);
+      const char* eol = nl ? nl : end;
+      w = std::max(w, line_width(m, p, (int) (eol - p)));
+      lines++;
+      if (!nl) break;
+      p = nl + 1;
+    }
+    mrb_ary_push(mrb, result, mrb_fixnum_value((mrb_int) (w + 0.999)));
+    mrb_ary_push(mrb, result, mrb_fixnum_value(lines * m.height));
+  }
+  fltk3::font(old_font, old_size);
+  return result;
+}
+
+static mrb_value
+mrb_fltk3_font_name(mrb_state *mrb, mrb_value self)
+{
+  mrb_value i;
+  mrb_get_args(mrb, "i", &i);
+  int font_type = 0;
+  const char *name = fltk3::get_font_name((fltk3::Font) mrb_fixnum(i), &font_type);
+  return name ? mrb_str_new_cstr(mrb, name) : mrb_nil_value();
+}
+
+#define DECLARE_WIDGET_CLASS(x, t)                                        \
+static mrb_value                                                          \
 mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
 {                                                                         \
   mrb_value *argv;                                                        \
@@ -346,18 +2401,19 @@ mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), argv[0]);           \
     return self;                                                          \
   } else if (arg_check("iiii", argc, argv)) {                             \
-    context->v = (fltk3::Widget*) new fltk3::x (                          \
+    context->v = (fltk3::Widget*) new mrb_fltk3_owned<t> (              \
       (int) mrb_fixnum(argv[0]),                                          \
       (int) mrb_fixnum(argv[1]),                                          \
       (int) mrb_fixnum(argv[2]),                                          \
       (int) mrb_fixnum(argv[3]));                                         \
   } else if (arg_check("iiiis", argc, argv)) {                            \
-    context->v = (fltk3::Widget*) new fltk3::x (                          \
+    context->v = (fltk3::Widget*) new mrb_fltk3_owned<t> (              \
       (int) mrb_fixnum(argv[0]),                                          \
       (int) mrb_fixnum(argv[1]),                                          \
       (int) mrb_fixnum(argv[2]),                                          \
-      (int) mrb_fixnum(argv[3]),                                          \
-      RSTRING_PTR(argv[4]));                                              \
+      (int) mrb_fixnum(argv[3]));                                         \
+    context->v->label(mrb_fltk3_str_ref(                                  \
+      context->v, MRB_FLTK3_STR_label, argv[4]));                         \
   } else {                                                                \
     mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid argument");                 \
   }                                                                       \
@@ -367,6 +2423,8 @@ mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
   return self;                                                            \
 }
 
+#define DECLARE_WIDGET(x) DECLARE_WIDGET_CLASS(x, fltk3::x)
+
 #define DECLARE_WINDOW(x)                                                 \
 static mrb_value                                                          \
 mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
@@ -381,20 +2439,23 @@ mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
   context->instance = self;                                               \
   context->mrb = mrb;                                                     \
   if (arg_check("iis", argc, argv)) {                                     \
-    context->v = (fltk3::Widget*) new fltk3::x (                          \
+    context->v = (fltk3::Widget*) new mrb_fltk3_owned<fltk3::x> (        \
       (int) mrb_fixnum(argv[0]),                                          \
-      (int) mrb_fixnum(argv[1]),                                          \
-      RSTRING_PTR(argv[2]));                                              \
+      (int) mrb_fixnum(argv[1]));                                         \
+    context->v->label(mrb_fltk3_str_ref(                                  \
+      context->v, MRB_FLTK3_STR_label, argv[2]));                         \
   } else if (arg_check("iiiis", argc, argv)) {                            \
-    context->v = (fltk3::Widget*) new fltk3::x (                          \
+    context->v = (fltk3::Widget*) new mrb_fltk3_owned<fltk3::x> (        \
       (int) mrb_fixnum(argv[0]),                                          \
       (int) mrb_fixnum(argv[1]),                                          \
       (int) mrb_fixnum(argv[2]),                                          \
-      (int) mrb_fixnum(argv[3]),                                          \
-      RSTRING_PTR(argv[4]));                                              \
+      (int) mrb_fixnum(argv[3]));                                         \
+    context->v->label(mrb_fltk3_str_ref(                                  \
+      context->v, MRB_FLTK3_STR_label, argv[4]));                         \
   } else {                                                                \
     mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid argument");                 \
   }                                                                       \
+  event_windows().push_back((fltk3::Window*) context->v);                 \
   mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(        \
     Data_Wrap_Struct(mrb, mrb->object_class,                              \
     &fltk3_Widget_type, (void*) context)));                               \
@@ -415,7 +2476,7 @@ mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
   return self;                                                            \
 }
 
-#define DECLARE_BOX(x)                                                    \
+#define DECLARE_BOX(x, c)                                                 \
 static mrb_value                                                          \
 mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
 {                                                                         \
@@ -427,8 +2488,11 @@ mrb_fltk3_ ## x ## _init(mrb_state *mrb, mrb_value self)                  \
   memset(context, 0, sizeof(mrb_fltk3_Widget_context));                   \
   context->instance = self;                                               \
   context->mrb = mrb;                                                     \
-  context->v = (fltk3::Widget*) new fltk3::x (                            \
-    mrb_nil_p(arg) ? NULL : RSTRING_PTR(arg));                            \
+  if (mrb_nil_p(arg))                                                     \
+    context->v = (fltk3::Widget*) fltk3::c;                               \
+  else                                                                    \
+    context->v = (fltk3::Widget*) new fltk3::x (                          \
+      mrb_fltk3_str_intern(RSTRING_PTR(arg), RSTRING_LEN(arg)));          \
   mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(        \
     Data_Wrap_Struct(mrb, mrb->object_class,                              \
     &fltk3_Widget_type, (void*) context)));                               \
@@ -441,8 +2505,8 @@ DECLARE_WIDGET(Widget)
 DECLARE_WIDGET(Browser)
 DECLARE_WIDGET(SelectBrowser)
 DECLARE_WIDGET(ValueOutput)
-DECLARE_WIDGET(Input)
-DECLARE_WIDGET(MenuBar)
+DECLARE_WIDGET_CLASS(Input, mrb_fltk3_input)
+DECLARE_WIDGET_CLASS(MenuBar, mrb_fltk3_menubar)
 
 DECLARE_WIDGET(Button)
 DECLARE_WIDGET(CheckButton)
@@ -461,59 +2525,189 @@ DECLARE_WIDGET(ToggleRoundButton)
 DECLARE_HIDDEN_OBJECT(Group, Widget)
 DECLARE_WIDGET(TextDisplay)
 DECLARE_WIDGET(TextEditor)
+DECLARE_WIDGET_CLASS(Flex, mrb_fltk3_flex)
+DECLARE_WIDGET_CLASS(Grid, mrb_fltk3_grid)
 
 DECLARE_WINDOW(DoubleWindow)
 DECLARE_WINDOW(Window)
 
 DECLARE_HIDDEN_OBJECT(Box, Widget)
-DECLARE_BOX(NoBox)
-DECLARE_BOX(FlatBox)
-DECLARE_BOX(UpBox)
-DECLARE_BOX(DownBox)
-DECLARE_BOX(ThinUpBox)
-DECLARE_BOX(ThinDownBox)
-DECLARE_BOX(EngravedBox)
-DECLARE_BOX(EmbossedBox)
-DECLARE_BOX(BorderBox)
-DECLARE_BOX(ShadowBox)
-DECLARE_BOX(RoundedBox)
-DECLARE_BOX(RShadowBox)
-DECLARE_BOX(RFlatBox)
-DECLARE_BOX(RoundUpBox)
-DECLARE_BOX(RoundDownBox)
-DECLARE_BOX(DiamondUpBox)
-DECLARE_BOX(DiamondDownBox)
-DECLARE_BOX(OvalBox)
-DECLARE_BOX(OShadowBox)
-DECLARE_BOX(OFlatBox)
-DECLARE_BOX(PlasticUpBox)
-DECLARE_BOX(PlasticDownBox)
-DECLARE_BOX(PlasticThinUpBox)
-DECLARE_BOX(PlasticThinDownBox)
-DECLARE_BOX(PlasticRoundUpBox)
-DECLARE_BOX(PlasticRoundDownBox)
-DECLARE_BOX(ClassicUpBox)
-DECLARE_BOX(ClassicDownBox)
-DECLARE_BOX(ClassicThinUpBox)
-DECLARE_BOX(ClassicThinDownBox)
-DECLARE_BOX(ClassicRoundUpBox)
-DECLARE_BOX(ClassicRoundDownBox)
-DECLARE_BOX(BorderFrame)
-DECLARE_BOX(UpFrame)
-DECLARE_BOX(DownFrame)
-DECLARE_BOX(ThinUpFrame)
-DECLARE_BOX(ThinDownFrame)
-DECLARE_BOX(EngravedFrame)
-DECLARE_BOX(EmbossedFrame)
-DECLARE_BOX(ShadowFrame)
-DECLARE_BOX(RoundedFrame)
-DECLARE_BOX(OvalFrame)
-DECLARE_BOX(PlasticUpFrame)
-DECLARE_BOX(PlasticDownFrame)
-DECLARE_BOX(ClassicUpFrame)
-DECLARE_BOX(ClassicDownFrame)
-DECLARE_BOX(ClassicThinUpFrame)
-DECLARE_BOX(ClassicThinDownFrame)
+DECLARE_BOX(NoBox, NO_BOX)
+DECLARE_BOX(FlatBox, FLAT_BOX)
+DECLARE_BOX(UpBox, UP_BOX)
+DECLARE_BOX(DownBox, DOWN_BOX)
+DECLARE_BOX(ThinUpBox, THIN_UP_BOX)
+DECLARE_BOX(ThinDownBox, THIN_DOWN_BOX)
+DECLARE_BOX(EngravedBox, ENGRAVED_BOX)
+DECLARE_BOX(EmbossedBox, EMBOSSED_BOX)
+DECLARE_BOX(BorderBox, BORDER_BOX)
+DECLARE_BOX(ShadowBox, SHADOW_BOX)
+DECLARE_BOX(RoundedBox, ROUNDED_BOX)
+DECLARE_BOX(RShadowBox, RSHADOW_BOX)
+DECLARE_BOX(RFlatBox, RFLAT_BOX)
+DECLARE_BOX(RoundUpBox, ROUND_UP_BOX)
+DECLARE_BOX(RoundDownBox, ROUND_DOWN_BOX)
+DECLARE_BOX(DiamondUpBox, DIAMOND_UP_BOX)
+DECLARE_BOX(DiamondDownBox, DIAMOND_DOWN_BOX)
+DECLARE_BOX(OvalBox, OVAL_BOX)
+DECLARE_BOX(OShadowBox, OSHADOW_BOX)
+DECLARE_BOX(OFlatBox, OFLAT_BOX)
+DECLARE_BOX(PlasticUpBox, PLASTIC_UP_BOX)
+DECLARE_BOX(PlasticDownBox, PLASTIC_DOWN_BOX)
+DECLARE_BOX(PlasticThinUpBox, PLASTIC_THIN_UP_BOX)
+DECLARE_BOX(PlasticThinDownBox, PLASTIC_THIN_DOWN_BOX)
+DECLARE_BOX(PlasticRoundUpBox, PLASTIC_ROUND_UP_BOX)
+DECLARE_BOX(PlasticRoundDownBox, PLASTIC_ROUND_DOWN_BOX)
+DECLARE_BOX(ClassicUpBox, CLASSIC_UP_BOX)
+DECLARE_BOX(ClassicDownBox, CLASSIC_DOWN_BOX)
+DECLARE_BOX(ClassicThinUpBox, CLASSIC_THIN_UP_BOX)
+DECLARE_BOX(ClassicThinDownBox, CLASSIC_THIN_DOWN_BOX)
+DECLARE_BOX(ClassicRoundUpBox, CLASSIC_ROUND_UP_BOX)
+DECLARE_BOX(ClassicRoundDownBox, CLASSIC_ROUND_DOWN_BOX)
+DECLARE_BOX(BorderFrame, BORDER_FRAME)
+DECLARE_BOX(UpFrame, UP_FRAME)
+DECLARE_BOX(DownFrame, DOWN_FRAME)
+DECLARE_BOX(ThinUpFrame, THIN_UP_FRAME)
+DECLARE_BOX(ThinDownFrame, THIN_DOWN_FRAME)
+DECLARE_BOX(EngravedFrame, ENGRAVED_FRAME)
+DECLARE_BOX(EmbossedFrame, EMBOSSED_FRAME)
+DECLARE_BOX(ShadowFrame, SHADOW_FRAME)
+DECLARE_BOX(RoundedFrame, ROUNDED_FRAME)
+DECLARE_BOX(OvalFrame, OVAL_FRAME)
+DECLARE_BOX(PlasticUpFrame, PLASTIC_UP_FRAME)
+DECLARE_BOX(PlasticDownFrame, PLASTIC_DOWN_FRAME)
+DECLARE_BOX(ClassicUpFrame, CLASSIC_UP_FRAME)
+DECLARE_BOX(ClassicDownFrame, CLASSIC_DOWN_FRAME)
+DECLARE_BOX(ClassicThinUpFrame, CLASSIC_THIN_UP_FRAME)
+DECLARE_BOX(ClassicThinDownFrame, CLASSIC_THIN_DOWN_FRAME)
+
+/*********************************************************
+ * FLTK3::Box
+ *********************************************************/
+/* Unnamed boxes wrap fltk3's builtin box of that type, so styling any number
+ * of widgets with FLTK3::UpBox.instance costs nothing per widget and a
+ * widget's default box maps back to the same object. */
+static const struct {
+  const char* name;
+  fltk3::Box* const* box;
+} box_types[] = {
+  {"NoBox", &fltk3::NO_BOX},
+  {"FlatBox", &fltk3::FLAT_BOX},
+  {"UpBox", &fltk3::UP_BOX},
+  {"DownBox", &fltk3::DOWN_BOX},
+  {"ThinUpBox", &fltk3::THIN_UP_BOX},
+  {"ThinDownBox", &fltk3::THIN_DOWN_BOX},
+  {"EngravedBox", &fltk3::ENGRAVED_BOX},
+  {"EmbossedBox", &fltk3::EMBOSSED_BOX},
+  {"BorderBox", &fltk3::BORDER_BOX},
+  {"ShadowBox", &fltk3::SHADOW_BOX},
+  {"RoundedBox", &fltk3::ROUNDED_BOX},
+  {"RShadowBox", &fltk3::RSHADOW_BOX},
+  {"RFlatBox", &fltk3::RFLAT_BOX},
+  {"RoundUpBox", &fltk3::ROUND_UP_BOX},
+  {"RoundDownBox", &fltk3::ROUND_DOWN_BOX},
+  {"DiamondUpBox", &fltk3::DIAMOND_UP_BOX},
+  {"DiamondDownBox", &fltk3::DIAMOND_DOWN_BOX},
+  {"OvalBox", &fltk3::OVAL_BOX},
+  {"OShadowBox", &fltk3::OSHADOW_BOX},
+  {"OFlatBox", &fltk3::OFLAT_BOX},
+  {"PlasticUpBox", &fltk3::PLASTIC_UP_BOX},
+  {"PlasticDownBox", &fltk3::PLASTIC_DOWN_BOX},
+  {"PlasticThinUpBox", &fltk3::PLASTIC_THIN_UP_BOX},
+  {"PlasticThinDownBox", &fltk3::PLASTIC_THIN_DOWN_BOX},
+  {"PlasticRoundUpBox", &fltk3::PLASTIC_ROUND_UP_BOX},
+  {"PlasticRoundDownBox", &fltk3::PLASTIC_ROUND_DOWN_BOX},
+  {"ClassicUpBox", &fltk3::CLASSIC_UP_BOX},
+  {"ClassicDownBox", &fltk3::CLASSIC_DOWN_BOX},
+  {"ClassicThinUpBox", &fltk3::CLASSIC_THIN_UP_BOX},
+  {"ClassicThinDownBox", &fltk3::CLASSIC_THIN_DOWN_BOX},
+  {"ClassicRoundUpBox", &fltk3::CLASSIC_ROUND_UP_BOX},
+  {"ClassicRoundDownBox", &fltk3::CLASSIC_ROUND_DOWN_BOX},
+  {"BorderFrame", &fltk3::BORDER_FRAME},
+  {"UpFrame", &fltk3::UP_FRAME},
+  {"DownFrame", &fltk3::DOWN_FRAME},
+  {"ThinUpFrame", &fltk3::THIN_UP_FRAME},
+  {"ThinDownFrame", &fltk3::THIN_DOWN_FRAME},
+  {"EngravedFrame", &fltk3::ENGRAVED_FRAME},
+  {"EmbossedFrame", &fltk3::EMBOSSED_FRAME},
+  {"ShadowFrame", &fltk3::SHADOW_FRAME},
+  {"RoundedFrame", &fltk3::ROUNDED_FRAME},
+  {"OvalFrame", &fltk3::OVAL_FRAME},
+  {"PlasticUpFrame", &fltk3::PLASTIC_UP_FRAME},
+  {"PlasticDownFrame", &fltk3::PLASTIC_DOWN_FRAME},
+  {"ClassicUpFrame", &fltk3::CLASSIC_UP_FRAME},
+  {"ClassicDownFrame", &fltk3::CLASSIC_DOWN_FRAME},
+  {"ClassicThinUpFrame", &fltk3::CLASSIC_THIN_UP_FRAME},
+  {"ClassicThinDownFrame", &fltk3::CLASSIC_THIN_DOWN_FRAME},
+};
+
+static mrb_value
+mrb_fltk3_box_instance(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym sym = mrb_intern_lit(mrb, "instance");
+  mrb_value instance = mrb_iv_get(mrb, self, sym);
+  if (mrb_nil_p(instance)) {
+    instance = mrb_class_new_instance(mrb, 0, NULL, mrb_class_ptr(self));
+    mrb_iv_set(mrb, self, sym, instance);
+  }
+  return instance;
+}
+
+// Only a named box needs its own native object; new without a name hands
+// out the shared instance instead of allocating another wrapper.
+static mrb_value
+mrb_fltk3_box_new(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *argv;
+  int argc;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  if (argc == 0) return mrb_fltk3_box_instance(mrb, self);
+  return mrb_class_new_instance(mrb, argc, argv, mrb_class_ptr(self));
+}
+
+static mrb_value
+mrb_fltk3_widget_box_get(mrb_state *mrb, mrb_value self)
+{
+  CONTEXT_SETUP(Widget);
+  fltk3::Box* box = context->v->box();
+  if (!box) return mrb_nil_value();
+  struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
+  size_t n;
+  for (n = 0; n < sizeof(box_types) / sizeof(box_types[0]); n++) {
+    if (*box_types[n].box == box) {
+      mrb_value klass = mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_cstr(mrb, box_types[n].name));
+      return mrb_fltk3_box_instance(mrb, klass);
+    }
+  }
+
+  // Boxes set natively (the widget defaults) are wrapped once and reused.
+  mrb_value klass = mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Box"));
+  mrb_value boxes = mrb_iv_get(mrb, klass, mrb_intern_lit(mrb, "boxes"));
+  if (mrb_nil_p(boxes)) {
+    boxes = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, klass, mrb_intern_lit(mrb, "boxes"), boxes);
+  }
+  for (n = 0; n < (size_t) RARRAY_LEN(boxes); n++) {
+    mrb_value box_value_context;
+    mrb_fltk3_Widget_context* box_context = NULL;
+    box_value_context = mrb_iv_get(mrb, RARRAY_PTR(boxes)[n], mrb_intern_lit(mrb, "context"));
+    Data_Get_Struct(mrb, box_value_context, &fltk3_Widget_type, box_context);
+    if ((fltk3::Box*) box_context->v == box) return RARRAY_PTR(boxes)[n];
+  }
+  mrb_fltk3_Widget_context* box_context =
+    (mrb_fltk3_Widget_context*) malloc(sizeof(mrb_fltk3_Widget_context));
+  if (!box_context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
+  memset(box_context, 0, sizeof(mrb_fltk3_Widget_context));
+  box_context->mrb = mrb;
+  box_context->v = (fltk3::Widget*) box;
+  mrb_value args[1];
+  args[0] = mrb_obj_value(
+    Data_Wrap_Struct(mrb, mrb->object_class,
+    &fltk3_Widget_type, (void*) box_context));
+  mrb_value instance = mrb_class_new_instance(mrb, 1, args, mrb_class_ptr(klass));
+  mrb_ary_push(mrb, boxes, instance);
+  return instance;
+}
 
 extern "C"
 {
@@ -524,6 +2718,32 @@ extern "C"
   mrb_define_method(mrb, _class_fltk3_ ## x, "resizable=", mrb_fltk3_group_resizable_set, ARGS_REQ(1)); \
   ARENA_RESTORE;
 
+#define INHERIT_LAYOUT(x) \
+  mrb_define_method(mrb, _class_fltk3_ ## x, "gap=", [] (mrb_state* mrb, mrb_value self) -> mrb_value { \
+    CONTEXT_SETUP(Widget); \
+    mrb_value vv; \
+    mrb_get_args(mrb, "i", &vv); \
+    mrb_fltk3_layout* layout = layout_self<mrb_fltk3_layout>(mrb, context->v); \
+    layout->gap = mrb_fixnum(vv); \
+    layout->layout(); \
+    return mrb_nil_value(); \
+  }, ARGS_REQ(1)); \
+  mrb_define_method(mrb, _class_fltk3_ ## x, "margin=", [] (mrb_state* mrb, mrb_value self) -> mrb_value { \
+    CONTEXT_SETUP(Widget); \
+    mrb_value vv; \
+    mrb_get_args(mrb, "i", &vv); \
+    mrb_fltk3_layout* layout = layout_self<mrb_fltk3_layout>(mrb, context->v); \
+    layout->margin = mrb_fixnum(vv); \
+    layout->layout(); \
+    return mrb_nil_value(); \
+  }, ARGS_REQ(1)); \
+  mrb_define_method(mrb, _class_fltk3_ ## x, "layout", [] (mrb_state* mrb, mrb_value self) -> mrb_value { \
+    CONTEXT_SETUP(Widget); \
+    layout_self<mrb_fltk3_layout>(mrb, context->v)->layout(); \
+    return mrb_nil_value(); \
+  }, ARGS_NONE()); \
+  ARENA_RESTORE;
+
 #define DEFINE_FIXNUM_PROP_READONLY(x, y, z) \
   mrb_define_method(mrb, _class_fltk3_ ## x, # z, [] (mrb_state* mrb, mrb_value self) -> mrb_value { \
     CONTEXT_SETUP(y); \
@@ -559,6 +2779,24 @@ extern "C"
   }, ARGS_NONE()); \
   ARENA_RESTORE;
 
+#define DEFINE_POOLED_STR_PROP(x, y, z) \
+  mrb_define_method(mrb, _class_fltk3_ ## x, # z, [] (mrb_state* mrb, mrb_value self) -> mrb_value { \
+    CONTEXT_SETUP(y); \
+    const char* vv = ((fltk3::x*) context->v)->z(); \
+    return mrb_fltk3_str_cached(mrb, self, context->v, MRB_FLTK3_STR_ ## z, \
+      mrb_intern_lit(mrb, # z "_ptr"), mrb_intern_lit(mrb, # z "_str"), vv); \
+  }, ARGS_NONE()); \
+  mrb_define_method(mrb, _class_fltk3_ ## x, # z "=", [] (mrb_state* mrb, mrb_value self) -> mrb_value { \
+    CONTEXT_SETUP(y); \
+    mrb_value vv; \
+    mrb_get_args(mrb, "S", &vv); \
+    ((fltk3::x*) context->v)->z(mrb_fltk3_str_ref(context->v, MRB_FLTK3_STR_ ## z, vv)); \
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, # z "_ptr"), mrb_nil_value()); \
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, # z "_str"), mrb_nil_value()); \
+    return mrb_nil_value(); \
+  }, ARGS_NONE()); \
+  ARENA_RESTORE;
+
 #define INHERIT_INPUT_VALUE(x) \
   mrb_define_method(mrb, _class_fltk3_ ## x, "value", mrb_fltk3_input_value_get, ARGS_NONE()); \
   mrb_define_method(mrb, _class_fltk3_ ## x, "value=", mrb_fltk3_input_value_set, ARGS_NONE()); \
@@ -569,28 +2807,41 @@ extern "C"
   mrb_define_method(mrb, _class_fltk3_ ## x, "initialize", mrb_fltk3_ ## x ## _init, ARGS_ANY()); \
   ARENA_RESTORE;
 
-void
-mrb_mruby_fltk3_gem_init(mrb_state* mrb)
+#define GET_CLASS(x) \
+  struct RClass* _class_fltk3_ ## x = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, # x)));
+
+#define DEFINE_FIXNUM_CONST(x) \
+  mrb_define_const(mrb, _class_fltk3, # x, mrb_fixnum_value(fltk3::x));
+
+/* FLTK3.init_usec adds up the time spent in gem init and in every lazily
+ * defined class group, so eager and lazy builds can be compared. */
+static void
+mrb_fltk3_init_usec(mrb_state* mrb, struct RClass* _class_fltk3, double start)
 {
-  ARENA_SAVE;
-  struct RClass* _class_fltk3 = mrb_define_module(mrb, "FLTK3");
-  mrb_define_module_function(mrb, _class_fltk3, "run", mrb_fltk3_run, ARGS_NONE());
-  mrb_define_module_function(mrb, _class_fltk3, "alert", mrb_fltk3_alert, ARGS_REQ(1));
-  mrb_define_module_function(mrb, _class_fltk3, "ask", mrb_fltk3_ask, ARGS_REQ(1));
-  mrb_define_module_function(mrb, _class_fltk3, "choice", mrb_fltk3_choice, ARGS_REQ(4));
-  mrb_define_module_function(mrb, _class_fltk3, "set_fonts", mrb_fltk3_set_fonts, ARGS_REQ(1));
-  mrb_define_module_function(mrb, _class_fltk3, "font_name", mrb_fltk3_font_name, ARGS_REQ(1));
-  mrb_define_module_function(mrb, _class_fltk3, "file_chooser", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
-    mrb_value message, pattern;
-    mrb_get_args(mrb, "SS", &message, &pattern);
-    const char *fname = fltk3::file_chooser(RSTRING_PTR(message), RSTRING_PTR(pattern), NULL);
-    if (fname) {
-      return mrb_str_new_cstr(mrb, fname);
-    }
-    return mrb_nil_value();
-  }, ARGS_REQ(2));
-  ARENA_RESTORE;
+  mrb_sym sym = mrb_intern_lit(mrb, "init_usec");
+  mrb_value usec = mrb_iv_get(mrb, mrb_obj_value(_class_fltk3), sym);
+  mrb_int total = mrb_fixnum_p(usec) ? mrb_fixnum(usec) : 0;
+  total += (mrb_int) ((mrb_fltk3_now() - start) * 1000000.0);
+  mrb_iv_set(mrb, mrb_obj_value(_class_fltk3), sym, mrb_fixnum_value(total));
+}
 
+static void
+mrb_fltk3_register_images(mrb_state* mrb)
+{
+  static bool registered = false;
+  if (registered) return;
+  double start = mrb_fltk3_now();
+  fltk3::register_images();
+  registered = true;
+  mrb_fltk3_init_usec(mrb, mrb_class_get(mrb, "FLTK3"), start);
+}
+
+static void
+mrb_fltk3_define_images(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Image"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
   struct RClass* _class_fltk3_Image = mrb_define_class_under(mrb, _class_fltk3, "Image", mrb->object_class);
   mrb_define_method(mrb, _class_fltk3_Image, "initialize", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
     mrb_value arg;
@@ -604,7 +2855,19 @@ mrb_mruby_fltk3_gem_init(mrb_state* mrb)
   DEFINE_FIXNUM_PROP_READONLY(Image, Image, ld);
   mrb_define_module_function(mrb, _class_fltk3_Image, "release", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
     CONTEXT_SETUP(Image);
-    ((fltk3::SharedImage*) context->v)->release();
+    mrb_value owner = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "owner"));
+    fltk3::SharedImage* shared = dynamic_cast<fltk3::SharedImage*>(context->v);
+    if (!mrb_nil_p(owner)) {
+      fltk3::Image* image = NULL;
+      Data_Get_Struct(mrb, owner, &fltk3_owned_image_type, image);
+      delete image;
+      DATA_PTR(owner) = NULL;
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "owner"), mrb_nil_value());
+    } else if (shared) {
+      shared->release();
+    } else {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "image is not owned by this object");
+    }
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_nil_value());
     return mrb_nil_value();
   }, ARGS_REQ(1));
@@ -614,24 +2877,16 @@ mrb_mruby_fltk3_gem_init(mrb_state* mrb)
     mrb_get_args(mrb, "ii", &width, &height);
     fltk3::Image* image = context->v->copy(mrb_fixnum(width), mrb_fixnum(height));
     if (!image) return mrb_nil_value();
-    mrb_fltk3_Image_context* image_context =
-      (mrb_fltk3_Image_context*) malloc(sizeof(mrb_fltk3_Image_context));
-    if (!image_context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
-    memset(image_context, 0, sizeof(mrb_fltk3_Image_context));
-    image_context->instance = self;
-    image_context->v = image;
-    mrb_value args[1];
-    struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
-    struct RClass* _class_fltk3_Image = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Image")));
-    args[0] = mrb_obj_value(
-      Data_Wrap_Struct(mrb, mrb->object_class,
-      &fltk3_Image_type, (void*) image_context));
-    return mrb_class_new_instance(mrb, 1, args, _class_fltk3_Image);
+    return mrb_fltk3_image_wrap(mrb, image);
   }, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Image, "data", mrb_fltk3_image_data, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Image, "phash", mrb_fltk3_image_phash, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Image, "diff", mrb_fltk3_image_diff, ARGS_REQ(1));
   DEFINE_CLASS(SharedImage, Image);
   mrb_define_module_function(mrb, _class_fltk3_SharedImage, "get", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
     mrb_value filename;
     mrb_get_args(mrb, "S", &filename);
+    mrb_fltk3_register_images(mrb);
     fltk3::Image* image = (fltk3::Image*) fltk3::SharedImage::get(RSTRING_PTR(filename));
     if (!image) return mrb_nil_value();
     mrb_fltk3_Image_context* image_context =
@@ -646,36 +2901,19 @@ mrb_mruby_fltk3_gem_init(mrb_state* mrb)
     args[0] = mrb_obj_value(
       Data_Wrap_Struct(mrb, mrb->object_class,
       &fltk3_Image_type, (void*) image_context));
-    return mrb_class_new_instance(mrb, 1, args, _class_fltk3_Image);
-  }, ARGS_REQ(1));
-  ARENA_RESTORE;
-
-  struct RClass* _class_fltk3_Widget = mrb_define_class_under(mrb, _class_fltk3, "Widget", mrb->object_class);
-  mrb_define_method(mrb, _class_fltk3_Widget, "initialize", mrb_fltk3_Widget_init, ARGS_ANY());
-  mrb_define_method(mrb, _class_fltk3_Widget, "redraw", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
-    CONTEXT_SETUP(Widget);
-    context->v->redraw();
-    return mrb_nil_value();
-  }, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_Widget, "show", mrb_fltk3_widget_show, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_Widget, "hide", mrb_fltk3_widget_hide, ARGS_NONE());
-  DEFINE_FIXNUM_PROP(Widget, Widget, x);
-  DEFINE_FIXNUM_PROP(Widget, Widget, y);
-  DEFINE_FIXNUM_PROP(Widget, Widget, w);
-  DEFINE_FIXNUM_PROP(Widget, Widget, h);
-  DEFINE_FIXNUM_PROP(Widget, Widget, labelfont);
-  DEFINE_FIXNUM_PROP(Widget, Widget, labelsize);
-  DEFINE_STR_PROP(Widget, Widget, label);
-  mrb_define_method(mrb, _class_fltk3_Widget, "box", mrb_fltk3_widget_box_get, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_Widget, "box=", mrb_fltk3_widget_box_set, ARGS_REQ(1));
-  mrb_define_method(mrb, _class_fltk3_Widget, "image", mrb_fltk3_widget_image_get, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_Widget, "image=", mrb_fltk3_widget_image_set, ARGS_REQ(1));
-  mrb_define_method(mrb, _class_fltk3_Widget, "visible", mrb_fltk3_widget_visible, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_Widget, "callback", mrb_fltk3_widget_callback, ARGS_OPT(1));
+    return mrb_class_new_instance(mrb, 1, args, _class_fltk3_Image);
+  }, ARGS_REQ(1));
   ARENA_RESTORE;
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
 
-  DEFINE_CLASS(ValueOutput, Widget);
-
+static void
+mrb_fltk3_define_buttons(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Button"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  GET_CLASS(Widget);
   DEFINE_CLASS(Button, Widget);
   DEFINE_CLASS(CheckButton, Button);
   DEFINE_CLASS(LightButton, Button);
@@ -689,47 +2927,16 @@ mrb_mruby_fltk3_gem_init(mrb_state* mrb)
   DEFINE_CLASS(ToggleButton, Button);
   DEFINE_CLASS(ToggleLightButton, Button);
   DEFINE_CLASS(ToggleRoundButton, Button);
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
 
-  DEFINE_CLASS(Input, Widget);
-  DEFINE_STR_PROP(Input, Widget, value);
-
-  struct RClass* _class_fltk3_MenuItem = mrb_define_class_under(mrb, _class_fltk3, "MenuItem", mrb->object_class);
-  mrb_define_method(mrb, _class_fltk3_MenuItem, "initialize", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
-    mrb_fltk3_MenuItem_context* context =
-      (mrb_fltk3_MenuItem_context*) malloc(sizeof(mrb_fltk3_MenuItem_context));
-    if (!context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
-    memset(context, 0, sizeof(mrb_fltk3_MenuItem_context));
-    context->instance = self;
-    context->v = new fltk3::MenuItem;
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(
-      Data_Wrap_Struct(mrb, mrb->object_class,
-      &fltk3_MenuItem_type, (void*) context)));
-    return self;
-  }, ARGS_NONE());
-
-  DEFINE_CLASS(MenuBar, MenuItem);
-  mrb_define_method(mrb, _class_fltk3_MenuBar, "add", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
-    CONTEXT_SETUP(Widget);
-    mrb_value b = mrb_nil_value(), caption, shortcut;
-    mrb_get_args(mrb, "&Si", &b, &caption, &shortcut);
-    ((fltk3::MenuBar*) context->v)->add(RSTRING_PTR(caption), mrb_fixnum(shortcut), [] (fltk3::Widget* w, void* d) {
-    });
-    return mrb_nil_value();
-  }, ARGS_REQ(1));
-  mrb_define_method(mrb, _class_fltk3_MenuBar, "menu", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
-    CONTEXT_SETUP(Widget);
-    struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
-    struct RClass* _class_fltk3_MenuItem = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "MenuItem")));
-    mrb_value args[1];
-    args[0] = mrb_obj_value(
-      Data_Wrap_Struct(mrb, mrb->object_class,
-      &fltk3_MenuItem_type, (void*) ((fltk3::MenuBar*) context->v)->menu()));
-    return mrb_class_new_instance(mrb, 1, args, _class_fltk3_MenuItem);
-  }, ARGS_NONE());
-
-  DEFINE_CLASS(Group, Widget);
-  INHERIT_GROUP(Group);
-
+static void
+mrb_fltk3_define_browsers(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Browser"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  GET_CLASS(Group);
   DEFINE_CLASS(Browser, Group);
   mrb_define_method(mrb, _class_fltk3_Browser, "load", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
     CONTEXT_SETUP(Widget);
@@ -821,19 +3028,70 @@ mrb_mruby_fltk3_gem_init(mrb_state* mrb)
     ((fltk3::Browser*) context->v)->column_widths(widths);
     return mrb_nil_value();
   }, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Browser, "filter", mrb_fltk3_browser_filter_set, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_method(mrb, _class_fltk3_Browser, "filter_clear", mrb_fltk3_browser_filter_clear, ARGS_NONE());
 
   DEFINE_CLASS(SelectBrowser, Browser);
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
 
+static void
+mrb_fltk3_define_text(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "TextDisplay"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  GET_CLASS(Group);
   DEFINE_CLASS(TextDisplay, Group);
   DEFINE_CLASS(TextEditor, TextDisplay);
 
-  struct RClass* _class_fltk3_Window = mrb_define_class_under(mrb, _class_fltk3, "Window", _class_fltk3_Widget);
-  mrb_define_method(mrb, _class_fltk3_Window, "initialize", mrb_fltk3_Window_init, ARGS_ANY());
-  mrb_define_method(mrb, _class_fltk3_Window, "show", mrb_fltk3_window_show, ARGS_OPT(1));
-  INHERIT_GROUP(Window);
-
-  DEFINE_CLASS(DoubleWindow, Window);
+  struct RClass* _class_fltk3_TextBuffer = mrb_define_class_under(mrb, _class_fltk3, "TextBuffer", mrb->object_class);
+  mrb_define_method(mrb, _class_fltk3_TextBuffer, "initialize", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    mrb_fltk3_TextBuffer_context* context =
+      (mrb_fltk3_TextBuffer_context*) malloc(sizeof(mrb_fltk3_TextBuffer_context));
+    if (!context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
+    memset(context, 0, sizeof(mrb_fltk3_TextBuffer_context));
+    context->instance = self;
+    context->v = new fltk3::TextBuffer;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(
+      Data_Wrap_Struct(mrb, mrb->object_class,
+      &fltk3_TextBuffer_type, (void*) context)));
+    return self;
+  }, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_TextDisplay, "buffer", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    CONTEXT_SETUP(Widget);
+    struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
+    struct RClass* _class_fltk3_TextBuffer = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "TextBuffer")));
+    mrb_value args[1];
+    args[0] = mrb_obj_value(
+      Data_Wrap_Struct(mrb, mrb->object_class,
+      &fltk3_TextBuffer_type, (void*) ((fltk3::TextDisplay*) context->v)->buffer()));
+    return mrb_class_new_instance(mrb, 1, args, _class_fltk3_TextBuffer);
+  }, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_TextDisplay, "buffer=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    CONTEXT_SETUP(Widget);
+    mrb_value textbuffer;
+    mrb_get_args(mrb, "o", &textbuffer);
+    mrb_value textbuffer_value_context;
+    mrb_fltk3_TextBuffer_context* textbuffer_context = NULL;
+    textbuffer_value_context = mrb_iv_get(mrb, textbuffer, mrb_intern_lit(mrb, "context"));
+    Data_Get_Struct(mrb, textbuffer_value_context, &fltk3_TextBuffer_type, textbuffer_context);
+    ((fltk3::TextDisplay*) context->v)->buffer(textbuffer_context->v);
+    return mrb_nil_value();
+  }, ARGS_REQ(1));
+  DEFINE_FIXNUM_PROP_READONLY(TextBuffer, TextBuffer, length);
+  DEFINE_STR_PROP(TextBuffer, TextBuffer, text);
+  ARENA_RESTORE;
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
 
+static void
+mrb_fltk3_define_boxes(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Box"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  GET_CLASS(Widget);
   DEFINE_CLASS(Box, Widget);
   DEFINE_CLASS(NoBox, Box);
   DEFINE_CLASS(FlatBox, Box);
@@ -883,46 +3141,309 @@ mrb_mruby_fltk3_gem_init(mrb_state* mrb)
   DEFINE_CLASS(ClassicDownFrame, Box);
   DEFINE_CLASS(ClassicThinUpFrame, Box);
   DEFINE_CLASS(ClassicThinDownFrame, Box);
+  // FLTK3::Box itself has no builtin box behind it, so only the concrete
+  // box classes get instance and the shortcut from new.
+  for (size_t n = 0; n < sizeof(box_types) / sizeof(box_types[0]); n++) {
+    struct RClass* klass = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_cstr(mrb, box_types[n].name)));
+    mrb_define_class_method(mrb, klass, "instance", mrb_fltk3_box_instance, ARGS_NONE());
+    mrb_define_class_method(mrb, klass, "new", mrb_fltk3_box_new, ARGS_OPT(1));
+  }
+  ARENA_RESTORE;
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
 
-  struct RClass* _class_fltk3_TextBuffer = mrb_define_class_under(mrb, _class_fltk3, "TextBuffer", mrb->object_class);
-  mrb_define_method(mrb, _class_fltk3_TextBuffer, "initialize", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
-    mrb_fltk3_TextBuffer_context* context =
-      (mrb_fltk3_TextBuffer_context*) malloc(sizeof(mrb_fltk3_TextBuffer_context));
-    if (!context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
-    memset(context, 0, sizeof(mrb_fltk3_TextBuffer_context));
-    context->instance = self;
-    context->v = new fltk3::TextBuffer;
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(
-      Data_Wrap_Struct(mrb, mrb->object_class,
-      &fltk3_TextBuffer_type, (void*) context)));
-    return self;
+static void
+mrb_fltk3_define_layout(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Flex"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  GET_CLASS(Group);
+  DEFINE_CLASS(Flex, Group);
+  mrb_define_method(mrb, _class_fltk3_Flex, "direction=", mrb_fltk3_flex_direction_set, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Flex, "set", mrb_fltk3_flex_set, ARGS_REQ(2) | ARGS_OPT(2));
+  DEFINE_CLASS(Grid, Group);
+  mrb_define_method(mrb, _class_fltk3_Grid, "place", mrb_fltk3_grid_place, ARGS_REQ(3) | ARGS_OPT(2));
+  mrb_define_method(mrb, _class_fltk3_Grid, "rows=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    CONTEXT_SETUP(Widget);
+    mrb_value rows;
+    mrb_get_args(mrb, "i", &rows);
+    mrb_fltk3_grid* grid = layout_self<mrb_fltk3_grid>(mrb, context->v);
+    grid->rows = mrb_fixnum(rows);
+    grid->layout();
+    return mrb_nil_value();
+  }, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Grid, "cols=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    CONTEXT_SETUP(Widget);
+    mrb_value cols;
+    mrb_get_args(mrb, "i", &cols);
+    mrb_fltk3_grid* grid = layout_self<mrb_fltk3_grid>(mrb, context->v);
+    grid->cols = mrb_fixnum(cols);
+    grid->layout();
+    return mrb_nil_value();
+  }, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Grid, "row_weights=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    CONTEXT_SETUP(Widget);
+    mrb_value arr;
+    mrb_get_args(mrb, "A", &arr);
+    mrb_fltk3_grid* grid = layout_self<mrb_fltk3_grid>(mrb, context->v);
+    weights_arg(mrb, arr, grid->row_weights);
+    grid->layout();
+    return mrb_nil_value();
+  }, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Grid, "col_weights=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    CONTEXT_SETUP(Widget);
+    mrb_value arr;
+    mrb_get_args(mrb, "A", &arr);
+    mrb_fltk3_grid* grid = layout_self<mrb_fltk3_grid>(mrb, context->v);
+    weights_arg(mrb, arr, grid->col_weights);
+    grid->layout();
+    return mrb_nil_value();
+  }, ARGS_REQ(1));
+  INHERIT_LAYOUT(Flex);
+  INHERIT_LAYOUT(Grid);
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
+
+static void
+mrb_fltk3_define_cell(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  if (mrb_const_defined(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "Cell"))) return;
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  struct RClass* _class_fltk3_Cell = mrb_define_class_under(mrb, _class_fltk3, "Cell", mrb->object_class);
+  mrb_define_method(mrb, _class_fltk3_Cell, "initialize", mrb_fltk3_cell_init, ARGS_OPT(1));
+  mrb_define_method(mrb, _class_fltk3_Cell, "value", mrb_fltk3_cell_value_get, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Cell, "value=", mrb_fltk3_cell_value_set, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Cell, "version", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return mrb_fixnum_value((mrb_int) cell_arg(mrb, self)->version.load());
   }, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_TextDisplay, "buffer", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+  ARENA_RESTORE;
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+}
+
+/* Class groups that are only defined when one of their constants is first
+ * looked up through FLTK3.const_missing. */
+static bool
+has_suffix(const char* name, const char* suffix)
+{
+  size_t n = strlen(name), l = strlen(suffix);
+  return n >= l && !strcmp(name + n - l, suffix);
+}
+
+static mrb_value
+mrb_fltk3_const_missing(mrb_state* mrb, mrb_value self)
+{
+  mrb_sym sym;
+  mrb_get_args(mrb, "n", &sym);
+  struct RClass* _class_fltk3 = mrb_class_ptr(self);
+  const char* name = mrb_sym2name(mrb, sym);
+  if (!strcmp(name, "Image") || !strcmp(name, "SharedImage"))
+    mrb_fltk3_define_images(mrb, _class_fltk3);
+  else if (has_suffix(name, "Button"))
+    mrb_fltk3_define_buttons(mrb, _class_fltk3);
+  else if (has_suffix(name, "Browser"))
+    mrb_fltk3_define_browsers(mrb, _class_fltk3);
+  else if (!strcmp(name, "Flex") || !strcmp(name, "Grid"))
+    mrb_fltk3_define_layout(mrb, _class_fltk3);
+  else if (!strcmp(name, "Cell"))
+    mrb_fltk3_define_cell(mrb, _class_fltk3);
+  else if (!strncmp(name, "Text", 4))
+    mrb_fltk3_define_text(mrb, _class_fltk3);
+  else if (has_suffix(name, "Box") || has_suffix(name, "Frame"))
+    mrb_fltk3_define_boxes(mrb, _class_fltk3);
+  if (!mrb_const_defined(mrb, self, sym))
+    mrb_name_error(mrb, sym, "uninitialized constant FLTK3::%S", mrb_sym2str(mrb, sym));
+  return mrb_const_get(mrb, self, sym);
+}
+
+static void
+mrb_fltk3_define_all(mrb_state* mrb, struct RClass* _class_fltk3)
+{
+  mrb_fltk3_define_images(mrb, _class_fltk3);
+  mrb_fltk3_define_buttons(mrb, _class_fltk3);
+  mrb_fltk3_define_browsers(mrb, _class_fltk3);
+  mrb_fltk3_define_text(mrb, _class_fltk3);
+  mrb_fltk3_define_boxes(mrb, _class_fltk3);
+  mrb_fltk3_define_layout(mrb, _class_fltk3);
+  mrb_fltk3_define_cell(mrb, _class_fltk3);
+}
+
+/* An unqualified lookup in a class that includes FLTK3 goes to that class's
+ * const_missing, not ours, so including the module defines every group. */
+static mrb_value
+mrb_fltk3_included(mrb_state* mrb, mrb_value self)
+{
+  mrb_value base;
+  mrb_get_args(mrb, "o", &base);
+  mrb_fltk3_define_all(mrb, mrb_class_ptr(self));
+  return mrb_nil_value();
+}
+
+void
+mrb_mruby_fltk3_gem_init(mrb_state* mrb)
+{
+  double start = mrb_fltk3_now();
+  ARENA_SAVE;
+  struct RClass* _class_fltk3 = mrb_define_module(mrb, "FLTK3");
+  fltk3::event_dispatch(mrb_fltk3_event_hook);
+  mrb_define_module_function(mrb, _class_fltk3, "run", mrb_fltk3_run, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "check", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return mrb_fixnum_value(fltk3::check());
+  }, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "alert", mrb_fltk3_alert, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "ask", mrb_fltk3_ask, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "choice", mrb_fltk3_choice, ARGS_REQ(4));
+  mrb_define_module_function(mrb, _class_fltk3, "set_fonts", mrb_fltk3_set_fonts, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "font_name", mrb_fltk3_font_name, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "fonts", mrb_fltk3_fonts, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "measure", mrb_fltk3_measure, ARGS_REQ(3));
+  mrb_define_module_function(mrb, _class_fltk3, "file_chooser", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    mrb_value message, pattern;
+    mrb_get_args(mrb, "SS", &message, &pattern);
+    // The chooser previews images through SharedImage.
+    mrb_fltk3_register_images(mrb);
+    const char *fname = fltk3::file_chooser(RSTRING_PTR(message), RSTRING_PTR(pattern), NULL);
+    if (fname) {
+      return mrb_str_new_cstr(mrb, fname);
+    }
+    return mrb_nil_value();
+  }, ARGS_REQ(2));
+  mrb_define_module_function(mrb, _class_fltk3, "simulate", mrb_fltk3_simulate, ARGS_REQ(2) | ARGS_REST());
+  mrb_define_module_function(mrb, _class_fltk3, "record", mrb_fltk3_record, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "record_stop", mrb_fltk3_record_stop, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "replay", mrb_fltk3_replay, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_module_function(mrb, _class_fltk3, "idle_gc", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return gc_sched.enabled ? mrb_true_value() : mrb_false_value();
+  }, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "idle_gc=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    mrb_value enabled;
+    mrb_get_args(mrb, "o", &enabled);
+    gc_sched.enabled = mrb_test(enabled);
+    return enabled;
+  }, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "gc_budget", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return mrb_fixnum_value(gc_sched.budget_usec);
+  }, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "gc_budget=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    mrb_value usec;
+    mrb_get_args(mrb, "i", &usec);
+    gc_sched.budget_usec = mrb_fixnum(usec);
+    return usec;
+  }, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "render_usec", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return mrb_fixnum_value(render_usec);
+  }, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "gc_stats", mrb_fltk3_gc_stats, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "refresh_rate", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return mrb_float_value(mrb, cell_refresh);
+  }, ARGS_NONE());
+  mrb_define_module_function(mrb, _class_fltk3, "refresh_rate=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    mrb_value hz;
+    mrb_get_args(mrb, "o", &hz);
+    double rate = 0;
+    if (mrb_float_p(hz)) rate = mrb_float(hz);
+    else if (mrb_fixnum_p(hz)) rate = mrb_fixnum(hz);
+    if (rate <= 0) mrb_raise(mrb, E_ARGUMENT_ERROR, "refresh rate must be positive");
+    cell_refresh = rate;
+    return hz;
+  }, ARGS_REQ(1));
+  mrb_define_module_function(mrb, _class_fltk3, "init_usec", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "init_usec"));
+  }, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject*) _class_fltk3, "const_missing", mrb_fltk3_const_missing, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject*) _class_fltk3, "included", mrb_fltk3_included, ARGS_REQ(1));
+  ARENA_RESTORE;
+
+  DEFINE_FIXNUM_CONST(MENU_INACTIVE);
+  DEFINE_FIXNUM_CONST(MENU_TOGGLE);
+  DEFINE_FIXNUM_CONST(MENU_VALUE);
+  DEFINE_FIXNUM_CONST(MENU_RADIO);
+  DEFINE_FIXNUM_CONST(MENU_INVISIBLE);
+  DEFINE_FIXNUM_CONST(MENU_DIVIDER);
+  DEFINE_FIXNUM_CONST(SHIFT);
+  DEFINE_FIXNUM_CONST(CTRL);
+  DEFINE_FIXNUM_CONST(ALT);
+  DEFINE_FIXNUM_CONST(META);
+  DEFINE_FIXNUM_CONST(COMMAND);
+
+  struct RClass* _class_fltk3_Widget = mrb_define_class_under(mrb, _class_fltk3, "Widget", mrb->object_class);
+  mrb_define_method(mrb, _class_fltk3_Widget, "initialize", mrb_fltk3_Widget_init, ARGS_ANY());
+  mrb_define_method(mrb, _class_fltk3_Widget, "redraw", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
     CONTEXT_SETUP(Widget);
-    struct RClass* _class_fltk3 = mrb_class_get(mrb, "FLTK3");
-    struct RClass* _class_fltk3_TextBuffer = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(_class_fltk3), mrb_intern_lit(mrb, "TextBuffer")));
-    mrb_value args[1];
-    args[0] = mrb_obj_value(
-      Data_Wrap_Struct(mrb, mrb->object_class,
-      &fltk3_TextBuffer_type, (void*) ((fltk3::TextDisplay*) context->v)->buffer()));
-    return mrb_class_new_instance(mrb, 1, args, _class_fltk3_TextBuffer);
+    context->v->redraw();
+    return mrb_nil_value();
   }, ARGS_NONE());
-  mrb_define_method(mrb, _class_fltk3_TextDisplay, "buffer=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+  mrb_define_method(mrb, _class_fltk3_Widget, "show", mrb_fltk3_widget_show, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Widget, "hide", mrb_fltk3_widget_hide, ARGS_NONE());
+  DEFINE_FIXNUM_PROP(Widget, Widget, x);
+  DEFINE_FIXNUM_PROP(Widget, Widget, y);
+  DEFINE_FIXNUM_PROP(Widget, Widget, w);
+  DEFINE_FIXNUM_PROP(Widget, Widget, h);
+  DEFINE_FIXNUM_PROP(Widget, Widget, labelfont);
+  DEFINE_FIXNUM_PROP(Widget, Widget, labelsize);
+  DEFINE_POOLED_STR_PROP(Widget, Widget, label);
+  mrb_define_method(mrb, _class_fltk3_Widget, "box", mrb_fltk3_widget_box_get, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Widget, "box=", mrb_fltk3_widget_box_set, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Widget, "image", mrb_fltk3_widget_image_get, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Widget, "image=", mrb_fltk3_widget_image_set, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Widget, "visible", mrb_fltk3_widget_visible, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_Widget, "callback", mrb_fltk3_widget_callback, ARGS_OPT(1));
+  mrb_define_method(mrb, _class_fltk3_Widget, "render_to_image", mrb_fltk3_widget_render_to_image, ARGS_OPT(1));
+  mrb_define_method(mrb, _class_fltk3_Widget, "bind", mrb_fltk3_widget_bind, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_method(mrb, _class_fltk3_Widget, "unbind", mrb_fltk3_widget_unbind, ARGS_NONE());
+  ARENA_RESTORE;
+
+  DEFINE_CLASS(ValueOutput, Widget);
+
+  DEFINE_CLASS(Input, Widget);
+  DEFINE_STR_PROP(Input, Widget, value);
+  mrb_define_method(mrb, _class_fltk3_Input, "filter=", mrb_fltk3_input_filter_set, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Input, "pattern=", mrb_fltk3_input_pattern_set, ARGS_REQ(1));
+  mrb_define_method(mrb, _class_fltk3_Input, "max_length=", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
     CONTEXT_SETUP(Widget);
-    mrb_value textbuffer;
-    mrb_get_args(mrb, "o", &textbuffer);
-    mrb_value textbuffer_value_context;
-    mrb_fltk3_TextBuffer_context* textbuffer_context = NULL;
-    textbuffer_value_context = mrb_iv_get(mrb, textbuffer, mrb_intern_lit(mrb, "context"));
-    Data_Get_Struct(mrb, textbuffer_value_context, &fltk3_TextBuffer_type, textbuffer_context);
-    ((fltk3::TextDisplay*) context->v)->buffer(textbuffer_context->v);
+    mrb_value max_length;
+    mrb_get_args(mrb, "i", &max_length);
+    input_arg(mrb, context->v)->max_length = mrb_fixnum(max_length);
     return mrb_nil_value();
   }, ARGS_REQ(1));
-  DEFINE_FIXNUM_PROP_READONLY(TextBuffer, TextBuffer, length);
-  DEFINE_STR_PROP(TextBuffer, TextBuffer, text);
-  ARENA_RESTORE;
+  mrb_define_method(mrb, _class_fltk3_Input, "on_change", mrb_fltk3_input_on_change, ARGS_OPT(2));
 
-  fltk3::register_images();
+  struct RClass* _class_fltk3_MenuItem = mrb_define_class_under(mrb, _class_fltk3, "MenuItem", mrb->object_class);
+  mrb_define_method(mrb, _class_fltk3_MenuItem, "initialize", [] (mrb_state* mrb, mrb_value self) -> mrb_value {
+    mrb_fltk3_MenuItem_context* context =
+      (mrb_fltk3_MenuItem_context*) malloc(sizeof(mrb_fltk3_MenuItem_context));
+    if (!context) mrb_raise(mrb, E_RUNTIME_ERROR, "can't alloc memory");
+    memset(context, 0, sizeof(mrb_fltk3_MenuItem_context));
+    context->instance = self;
+    context->v = new fltk3::MenuItem;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "context"), mrb_obj_value(
+      Data_Wrap_Struct(mrb, mrb->object_class,
+      &fltk3_MenuItem_type, (void*) context)));
+    return self;
+  }, ARGS_NONE());
+
+  DEFINE_CLASS(MenuBar, MenuItem);
+  mrb_define_method(mrb, _class_fltk3_MenuBar, "add", mrb_fltk3_menubar_add, ARGS_REQ(1) | ARGS_OPT(2));
+  mrb_define_method(mrb, _class_fltk3_MenuBar, "menu", mrb_fltk3_menubar_menu_get, ARGS_NONE());
+  mrb_define_method(mrb, _class_fltk3_MenuBar, "menu=", mrb_fltk3_menubar_menu_set, ARGS_REQ(1));
+
+  DEFINE_CLASS(Group, Widget);
+  INHERIT_GROUP(Group);
+
+  struct RClass* _class_fltk3_Window = mrb_define_class_under(mrb, _class_fltk3, "Window", _class_fltk3_Widget);
+  mrb_define_method(mrb, _class_fltk3_Window, "initialize", mrb_fltk3_Window_init, ARGS_ANY());
+  mrb_define_method(mrb, _class_fltk3_Window, "show", mrb_fltk3_window_show, ARGS_OPT(1));
+  INHERIT_GROUP(Window);
+
+  DEFINE_CLASS(DoubleWindow, Window);
+
+  mrb_fltk3_init_usec(mrb, _class_fltk3, start);
+
+#ifdef MRB_FLTK3_EAGER_INIT
+  mrb_fltk3_define_all(mrb, _class_fltk3);
+  mrb_fltk3_register_images(mrb);
+#endif
 }
 
 void